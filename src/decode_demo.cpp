@@ -0,0 +1,232 @@
+#include "decoder.hpp"
+#include "format.hpp"
+#include "frame_ring.hpp"
+#include "image.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+
+#include <sched.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+namespace {
+const int32_t RING_SLOTS = 4;
+
+int64_t now_ns() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+// The frames are output as gray images. The planes of multi-plane frames are stacked, with the
+// chroma planes side by side below the luma plane.
+struct frame_layout {
+  int32_t width;
+  int32_t height;
+  int32_t plane_x[lomc::MAX_PLANES];
+  int32_t plane_y[lomc::MAX_PLANES];
+};
+
+frame_layout get_frame_layout(const lomc::decoder& dec) {
+  frame_layout layout = {dec.output_width(0), dec.output_height(0), {0}, {0}};
+  int32_t chroma_width = 0;
+  for (int32_t plane = 1; plane < dec.num_planes(); ++plane) {
+    layout.plane_x[plane] = chroma_width;
+    layout.plane_y[plane] = dec.output_height(0);
+    chroma_width += dec.output_width(plane);
+    layout.height = dec.output_height(0) + dec.output_height(plane);
+  }
+  layout.width = std::max(layout.width, chroma_width);
+  return layout;
+}
+
+bool decode_frame(lomc::decoder& dec,
+                  const frame_layout& layout,
+                  uint8_t* pixels,
+                  const int32_t stride) {
+  uint8_t* planes[lomc::MAX_PLANES];
+  int32_t strides[lomc::MAX_PLANES];
+  for (int32_t plane = 0; plane < dec.num_planes(); ++plane) {
+    planes[plane] = &pixels[(layout.plane_y[plane] * stride) + layout.plane_x[plane]];
+    strides[plane] = stride;
+  }
+  return dec.decode_frame(planes, strides);
+}
+
+// Decode all frames to PGM files.
+void decode_to_files(lomc::decoder& dec) {
+  const frame_layout layout = get_frame_layout(dec);
+  lomc::image img(layout.width, layout.height);
+  while (decode_frame(dec, layout, &img[0], img.stride())) {
+    std::ostringstream file_name;
+    file_name << "out_dec_" << std::setfill('0') << std::setw(4) << dec.frame_no() << ".pgm";
+    img.save(file_name.str());
+  }
+}
+
+// Consumer process: Read frames from the shared memory ring and measure the latency from the
+// start of decoding a frame until the frame is available to the consumer.
+int consume_frames(const std::string& ring_name, const pid_t producer_pid) {
+  lomc::frame_ring ring(ring_name);
+  int64_t total_latency = 0;
+  int64_t max_latency = 0;
+  uint32_t checksum = 0u;
+  int32_t num_frames = 0;
+  for (;; ++num_frames) {
+    int64_t timestamp;
+    const uint8_t* pixels;
+    while ((pixels = ring.try_begin_read(timestamp)) == nullptr) {
+      // If the producer has died, the consumer is re-parented and no more frames will arrive.
+      if (getppid() != producer_pid) {
+        throw std::runtime_error("The producer process exited");
+      }
+      sched_yield();
+    }
+
+    // A negative timestamp marks the end of the stream.
+    if (timestamp < 0) {
+      ring.end_read();
+      break;
+    }
+    const int64_t latency = now_ns() - timestamp;
+    total_latency += latency;
+    max_latency = std::max(max_latency, latency);
+
+    // Use the frame in place.
+    for (int32_t y = 0; y < ring.height(); ++y) {
+      const uint8_t* row = &pixels[y * ring.stride()];
+      for (int32_t x = 0; x < ring.width(); ++x) {
+        checksum = (checksum * 31u) + row[x];
+      }
+    }
+
+    ring.end_read();
+  }
+
+  if (num_frames > 0) {
+    std::cout << "Frames: " << num_frames << "\n";
+    std::cout << "Average latency: " << (1e-6 * static_cast<double>(total_latency / num_frames))
+              << " ms\n";
+    std::cout << "Max latency: " << (1e-6 * static_cast<double>(max_latency)) << " ms\n";
+    std::cout << "Checksum: " << std::hex << checksum << std::dec << "\n";
+  }
+  return 0;
+}
+
+// Producer process: Decode all frames directly into the slots of a shared memory ring, which is
+// read by a separate consumer process.
+void decode_to_ring(lomc::decoder& dec) {
+  std::ostringstream ring_name;
+  ring_name << "/lomc_decode_demo_" << getpid();
+  const frame_layout layout = get_frame_layout(dec);
+  lomc::frame_ring ring(ring_name.str(), layout.width, layout.height, RING_SLOTS);
+
+  std::cout << std::flush;
+  const pid_t producer_pid = getpid();
+  const pid_t pid = fork();
+  if (pid < 0) {
+    throw std::runtime_error("Failed to start the consumer process");
+  }
+  if (pid == 0) {
+    int result;
+    try {
+      result = consume_frames(ring_name.str(), producer_pid);
+    } catch (std::exception& e) {
+      std::cerr << "EXCEPTION (consumer): " << e.what() << std::endl;
+      result = 1;
+    }
+    std::cout << std::flush;
+    _exit(result);
+  }
+
+  int32_t num_frames = 0;
+  bool more_frames = true;
+  while (more_frames) {
+    uint8_t* pixels;
+    while ((pixels = ring.try_begin_write()) == nullptr) {
+      // If the consumer has exited, the slots will never be released.
+      int status;
+      if (waitpid(pid, &status, WNOHANG) != 0) {
+        throw std::runtime_error("The consumer process exited");
+      }
+      sched_yield();
+    }
+    const int64_t timestamp = now_ns();
+    more_frames = decode_frame(dec, layout, pixels, ring.stride());
+    ring.end_write(more_frames ? timestamp : -1);
+    if (more_frames) {
+      ++num_frames;
+    }
+  }
+
+  int status;
+  if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    throw std::runtime_error("The consumer process failed");
+  }
+
+  // The frames are never copied between the processes, but the decoder writes each pixel to the
+  // output slot, and also to its internal reference frame (and filter image) unless the frame is
+  // never referenced. With temporal layers, the filter image of a reference frame that is still
+  // needed later is also copied before it is updated. The copies are counted in units of one
+  // frame.
+  if (num_frames > 0) {
+    int64_t output_frame_bytes = 0;
+    int64_t frame_bytes = 0;
+    for (int32_t plane = 0; plane < dec.num_planes(); ++plane) {
+      output_frame_bytes +=
+          static_cast<int64_t>(dec.output_width(plane)) * dec.output_height(plane);
+      frame_bytes += static_cast<int64_t>(lomc::plane_size(dec.width(), dec.format(), plane)) *
+                     lomc::plane_size(dec.height(), dec.format(), plane);
+    }
+    const auto copies = [num_frames](const int64_t bytes, const int64_t bytes_per_frame) {
+      return static_cast<double>(bytes) / static_cast<double>(num_frames * bytes_per_frame);
+    };
+    const lomc::decode_stats& stats = dec.stats();
+    std::cout << "Copies per frame: " << copies(stats.output_bytes, output_frame_bytes)
+              << " output, " << copies(stats.reference_bytes, frame_bytes) << " reference, "
+              << copies(stats.filter_bytes, frame_bytes) << " filter, 0 between processes\n";
+  }
+}
+}  // namespace
+
+int main(int argc, const char** argv) {
+  try {
+    bool use_ring = false;
+    int32_t max_layer = lomc::MAX_TEMPORAL_LAYERS - 1;
+    int32_t scale_shift = 0;
+    std::string file_name = "packed.lmc";
+    for (int i = 1; i < argc; ++i) {
+      const std::string arg = argv[i];
+      if (arg == "--ring") {
+        use_ring = true;
+      } else if (arg == "--max-layer" && (i + 1) < argc) {
+        max_layer = std::stoi(argv[++i]);
+      } else if (arg == "--scale" && (i + 1) < argc) {
+        scale_shift = std::stoi(argv[++i]);
+      } else {
+        file_name = arg;
+      }
+    }
+
+    lomc::decoder dec(file_name);
+    dec.set_max_temporal_layer(max_layer);
+    dec.set_output_scale(scale_shift);
+    if (use_ring) {
+      decode_to_ring(dec);
+    } else {
+      decode_to_files(dec);
+    }
+  } catch (std::exception& e) {
+    std::cerr << "EXCEPTION: " << e.what() << std::endl;
+    return 1;
+  }
+
+  return 0;
+}
@@ -0,0 +1,455 @@
+#include "decoder.hpp"
+
+#include "format.hpp"
+#include "packbits.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+namespace lomc {
+namespace {
+int32_t packed_row_size(const uint8_t num_bits) {
+  return 2 * static_cast<int32_t>(num_bits);
+}
+
+// Downscale a width x height region by 2^scale_shift in both directions, using a box filter. The
+// region must start at a multiple of 2^scale_shift (which is true for all blocks). Partial cells at
+// the right and bottom edges are averaged over the available pixels.
+void downscale(const uint8_t* src,
+               const int32_t src_stride,
+               const int32_t width,
+               const int32_t height,
+               const int32_t scale_shift,
+               uint8_t* dst,
+               const int32_t dst_stride) {
+  const int32_t scale = 1 << scale_shift;
+  for (int32_t y = 0; y < height; y += scale) {
+    const int32_t cell_h = std::min(scale, height - y);
+    uint8_t* dst_row = dst;
+    for (int32_t x = 0; x < width; x += scale) {
+      const int32_t cell_w = std::min(scale, width - x);
+      uint32_t sum = 0u;
+      const uint8_t* cell = &src[x];
+      for (int32_t i = 0; i < cell_h; ++i) {
+        for (int32_t j = 0; j < cell_w; ++j) {
+          sum += static_cast<uint32_t>(cell[j]);
+        }
+        cell += src_stride;
+      }
+      const uint32_t count = static_cast<uint32_t>(cell_w * cell_h);
+      *dst_row++ = static_cast<uint8_t>((sum + (count >> 1)) / count);
+    }
+    src += scale * src_stride;
+    dst += dst_stride;
+  }
+}
+}  // namespace
+
+decoder::decoder(const std::string& file_name)
+    : file_(file_name.c_str(), std::ios::in | std::ios::binary),
+      max_layer_(MAX_TEMPORAL_LAYERS - 1),
+      requested_max_layer_(MAX_TEMPORAL_LAYERS - 1),
+      scale_shift_(0),
+      store_reference_(true),
+      frame_no_(0) {
+  if (!file_) {
+    throw std::runtime_error("Failed to open " + file_name);
+  }
+
+  // Read the file header.
+  uint8_t header[FILE_HEADER_SIZE];
+  file_.read(reinterpret_cast<char*>(header), FILE_HEADER_SIZE);
+  if (!file_ || std::memcmp(header, "LOMC", 4) != 0) {
+    throw std::runtime_error("Not a LOMC file");
+  }
+  if (header[4] != FILE_VERSION) {
+    throw std::runtime_error("Unsupported LOMC version");
+  }
+  width_ = unpack_int32(&header[5]);
+  height_ = unpack_int32(&header[9]);
+  num_frames_ = unpack_int32(&header[13]);
+  flags_ = static_cast<uint32_t>(unpack_int32(&header[17]));
+  num_layers_ =
+      static_cast<int32_t>((flags_ & FILE_TEMPORAL_LAYERS_MASK) >> FILE_TEMPORAL_LAYERS_SHIFT) + 1;
+  const uint32_t format = (flags_ & FILE_PIXEL_FORMAT_MASK) >> FILE_PIXEL_FORMAT_SHIFT;
+  if (width_ < 1 || height_ < 1 || num_frames_ < 0 || format > PIXEL_FORMAT_YUV420) {
+    throw std::runtime_error("Invalid LOMC header");
+  }
+  format_ = static_cast<pixel_format>(format);
+
+  packed_frame_data_.resize(static_cast<size_t>(max_packed_frame_size(width_, height_, format_)));
+
+  // The reference frames of the planes follow the same temporal layer structure.
+  refs_.reserve(static_cast<size_t>(num_planes()));
+  for (int32_t plane = 0; plane < num_planes(); ++plane) {
+    refs_.emplace_back(plane_size(width_, format_, plane),
+                       plane_size(height_, format_, plane),
+                       num_layers_,
+                       (flags_ & FILE_FLAG_FILTER) != 0u);
+  }
+}
+
+void decoder::set_max_temporal_layer(const int32_t max_layer) {
+  requested_max_layer_ = max_layer;
+
+  // Frames above the current max layer may not have been stored, so raising the max layer must
+  // wait for the next base layer frame.
+  if (requested_max_layer_ < max_layer_) {
+    max_layer_ = requested_max_layer_;
+  }
+}
+
+void decoder::set_output_scale(const int32_t scale_shift) {
+  if (scale_shift < 0 || scale_shift > MAX_OUTPUT_SCALE_SHIFT) {
+    throw std::runtime_error("Invalid output scale");
+  }
+  scale_shift_ = scale_shift;
+}
+
+bool decoder::decode_frame(uint8_t* pixels, const int32_t stride) {
+  if (num_planes() != 1) {
+    throw std::runtime_error("Multi-plane frames need one output buffer per plane");
+  }
+  return decode_frame(&pixels, &stride);
+}
+
+bool decoder::decode_frame(uint8_t* const* planes, const int32_t* strides) {
+  if (frame_no_ >= num_frames_) {
+    return false;
+  }
+  for (int32_t plane = 0; plane < num_planes(); ++plane) {
+    if (strides[plane] < output_width(plane)) {
+      throw std::runtime_error("Invalid output stride");
+    }
+  }
+
+  // Read the next frame in a decoded layer. The frames in the other layers are skipped.
+  uint8_t frame_flags;
+  while (!read_frame(frame_flags)) {
+    ++frame_no_;
+    if (frame_no_ >= num_frames_) {
+      return false;
+    }
+  }
+  const int32_t layer =
+      static_cast<int32_t>((frame_flags & FRAME_TEMPORAL_LAYER_MASK) >> FRAME_TEMPORAL_LAYER_SHIFT);
+  if (layer != temporal_layer(frame_no_, num_layers_)) {
+    throw std::runtime_error("Invalid temporal layer");
+  }
+  store_reference_ = is_referenced_later(layer);
+
+  // An unchanged frame leaves the decoder state as is.
+  if ((frame_flags & FRAME_FLAG_UNCHANGED) != 0u) {
+    for (int32_t plane = 0; plane < num_planes(); ++plane) {
+      reference_frames& refs = refs_[static_cast<size_t>(plane)];
+      refs.begin_frame(frame_no_);
+      const image& ref_img = refs.reference();
+      write_output(
+          ref_img, 0, 0, ref_img.width(), ref_img.height(), planes[plane], strides[plane]);
+      refs.end_frame(true);
+    }
+    ++frame_no_;
+    return true;
+  }
+
+  // Decode the planes, one after the other.
+  const uint8_t* packed = &packed_frame_data_[FRAME_HEADER_SIZE];
+  const uint8_t* packed_end = &packed_frame_data_[unpack_int32(&packed_frame_data_[0])];
+  for (int32_t plane = 0; plane < num_planes(); ++plane) {
+    if (packed_end - packed < PLANE_HEADER_SIZE) {
+      throw std::runtime_error("Invalid packed plane");
+    }
+    const int32_t packed_control_data_size = unpack_int32(&packed[0]);
+    const int32_t packed_block_data_size = unpack_int32(&packed[4]);
+    packed += PLANE_HEADER_SIZE;
+    if (packed_control_data_size < 0 || packed_block_data_size < 0 ||
+        packed_control_data_size > packed_end - packed ||
+        packed_block_data_size > packed_end - packed - packed_control_data_size) {
+      throw std::runtime_error("Invalid packed plane");
+    }
+
+    reference_frames& refs = refs_[static_cast<size_t>(plane)];
+    refs.begin_frame(frame_no_);
+    stats_.filter_bytes += refs.begin_filter();
+    decode_plane(refs,
+                 packed,
+                 packed + packed_control_data_size,
+                 packed + packed_control_data_size + packed_block_data_size,
+                 planes[plane],
+                 strides[plane]);
+    refs.end_frame(false);
+    packed += packed_control_data_size + packed_block_data_size;
+  }
+  if (packed != packed_end) {
+    throw std::runtime_error("Invalid packed frame");
+  }
+
+  ++frame_no_;
+  return true;
+}
+
+void decoder::decode_plane(reference_frames& refs,
+                           const uint8_t* control,
+                           const uint8_t* control_end,
+                           const uint8_t* packed_end,
+                           uint8_t* pixels,
+                           const int32_t stride) {
+  // Decode all the blocks. Runs of skip blocks are handled one block row at a time.
+  const int32_t width = refs.reference().width();
+  const int32_t height = refs.reference().height();
+  const uint8_t* packed = control_end;
+  uint8_t control_byte = 0u;
+  int32_t run_length = 0;
+  for (int32_t y = 0; y < height; y += BLOCK_HEIGHT) {
+    const int32_t block_h = std::min(BLOCK_HEIGHT, height - y);
+    for (int32_t x = 0; x < width;) {
+      if (run_length == 0) {
+        if (control >= control_end) {
+          throw std::runtime_error("Control data overflow");
+        }
+        control_byte = *control++;
+        run_length = 1;
+        if ((control_byte & CONTROL_RUN) != 0u) {
+          if (control >= control_end) {
+            throw std::runtime_error("Control data overflow");
+          }
+          control_byte &= static_cast<uint8_t>(~CONTROL_RUN);
+          run_length = static_cast<int32_t>(*control++) + MIN_CONTROL_RUN;
+        }
+      }
+
+      if (control_byte == CONTROL_SKIP) {
+        const int32_t num_blocks =
+            std::min(run_length, (width - x + BLOCK_WIDTH - 1) / BLOCK_WIDTH);
+        const int32_t span_w = std::min(num_blocks * BLOCK_WIDTH, width - x);
+        skip_blocks(refs, x, y, span_w, block_h, pixels, stride);
+        x += num_blocks * BLOCK_WIDTH;
+        run_length -= num_blocks;
+      } else {
+        const int32_t block_w = std::min(BLOCK_WIDTH, width - x);
+        decode_block(
+            refs, x, y, block_w, block_h, control_byte, packed, packed_end, pixels, stride);
+        x += BLOCK_WIDTH;
+        --run_length;
+      }
+    }
+  }
+  if (run_length != 0 || control != control_end || packed != packed_end) {
+    throw std::runtime_error("Invalid control data");
+  }
+}
+
+bool decoder::is_referenced_later(const int32_t layer) const {
+  // Frames in the top decoded layer are not referenced by any decoded frame (unless the base layer
+  // is the top layer).
+  const int32_t top_layer = std::min(max_layer_, num_layers_ - 1);
+  if (!is_reference_layer(layer, top_layer + 1)) {
+    return false;
+  }
+
+  // Neither is the last decoded frame.
+  for (int32_t n = frame_no_ + 1; n < num_frames_; ++n) {
+    if (temporal_layer(n, num_layers_) <= max_layer_) {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool decoder::read_frame(uint8_t& frame_flags) {
+  uint8_t* frame_header = packed_frame_data_.data();
+  file_.read(reinterpret_cast<char*>(frame_header), FRAME_HEADER_SIZE);
+  const int32_t packed_frame_size = unpack_int32(&frame_header[0]);
+  frame_flags = frame_header[4];
+  if (!file_ || packed_frame_size < FRAME_HEADER_SIZE ||
+      packed_frame_size > static_cast<int32_t>(packed_frame_data_.size())) {
+    throw std::runtime_error("Invalid packed frame");
+  }
+
+  // Skip frames in layers that are not decoded.
+  const int32_t layer =
+      static_cast<int32_t>((frame_flags & FRAME_TEMPORAL_LAYER_MASK) >> FRAME_TEMPORAL_LAYER_SHIFT);
+  if (layer == 0) {
+    max_layer_ = requested_max_layer_;
+  }
+  if (layer > max_layer_) {
+    file_.seekg(packed_frame_size - FRAME_HEADER_SIZE, std::ios::cur);
+    return false;
+  }
+
+  file_.read(reinterpret_cast<char*>(&packed_frame_data_[FRAME_HEADER_SIZE]),
+             packed_frame_size - FRAME_HEADER_SIZE);
+  if (!file_) {
+    throw std::runtime_error("Failed to read packed frame");
+  }
+  return true;
+}
+
+void decoder::skip_blocks(reference_frames& refs,
+                          const int32_t x,
+                          const int32_t y,
+                          const int32_t span_w,
+                          const int32_t block_h,
+                          uint8_t* pixels,
+                          const int32_t stride) {
+  const image& ref_img = refs.reference();
+  if (store_reference_) {
+    image& img = refs.current();
+    for (int32_t row = 0; row < block_h; ++row) {
+      const int32_t yy = y + row;
+      std::memcpy(&img[(yy * img.stride()) + x],
+                  &ref_img[(yy * ref_img.stride()) + x],
+                  static_cast<size_t>(span_w));
+    }
+    stats_.reference_bytes += static_cast<int64_t>(span_w) * block_h;
+  }
+  write_output(ref_img, x, y, span_w, block_h, pixels, stride);
+}
+
+void decoder::write_output(const image& img,
+                           const int32_t x,
+                           const int32_t y,
+                           const int32_t w,
+                           const int32_t h,
+                           uint8_t* pixels,
+                           const int32_t stride) {
+  write_output(&img[(y * img.stride()) + x], img.stride(), x, y, w, h, pixels, stride);
+}
+
+void decoder::write_output(const uint8_t* src,
+                           const int32_t src_stride,
+                           const int32_t x,
+                           const int32_t y,
+                           const int32_t w,
+                           const int32_t h,
+                           uint8_t* pixels,
+                           const int32_t stride) {
+  uint8_t* dst = &pixels[((y >> scale_shift_) * stride) + (x >> scale_shift_)];
+  const int32_t round = (1 << scale_shift_) - 1;
+  stats_.output_bytes +=
+      static_cast<int64_t>((w + round) >> scale_shift_) * ((h + round) >> scale_shift_);
+  if (scale_shift_ > 0) {
+    downscale(src, src_stride, w, h, scale_shift_, dst, stride);
+    return;
+  }
+  for (int32_t row = 0; row < h; ++row) {
+    std::memcpy(dst, src, static_cast<size_t>(w));
+    src += src_stride;
+    dst += stride;
+  }
+}
+
+void decoder::decode_block(reference_frames& refs,
+                           const int32_t x,
+                           const int32_t y,
+                           const int32_t block_w,
+                           const int32_t block_h,
+                           const uint8_t control_byte,
+                           const uint8_t*& packed,
+                           const uint8_t* packed_end,
+                           uint8_t* pixels,
+                           const int32_t stride) {
+  const image& ref_img = refs.reference();
+  image& filter_image = refs.filter_image();
+  const bool use_filter = (flags_ & FILE_FLAG_FILTER) != 0u;
+
+  const uint8_t num_bits = control_byte & CONTROL_NUM_BITS_MASK;
+  const int32_t bt = (control_byte & CONTROL_BLOCK_TYPE_MASK) >> CONTROL_BLOCK_TYPE_SHIFT;
+  if (bt != BLOCK_DELTA_FRAME && bt != BLOCK_DELTA_ROW && bt != BLOCK_COPY) {
+    throw std::runtime_error("Invalid block type");
+  }
+
+  // Get the motion vector (if any).
+  const bool has_motion = (control_byte & CONTROL_MOTION) != 0u;
+  int32_t motion_dx = 0;
+  int32_t motion_dy = 0;
+  if (has_motion) {
+    if (packed >= packed_end) {
+      throw std::runtime_error("Packed frame data overflow");
+    }
+    unpack_motion(*packed++, motion_dx, motion_dy);
+    if (x + motion_dx < 0 || x + motion_dx + block_w > ref_img.width() || y + motion_dy < 0 ||
+        y + motion_dy + block_h > ref_img.height()) {
+      throw std::runtime_error("Invalid motion vector");
+    }
+  }
+  const image& delta_img = (has_motion && use_filter) ? filter_image : ref_img;
+
+  // Unpack the deltas and reconstruct the block, one row at a time.
+  // Special case: BLOCK_DELTA_ROW always uses 8 bits for the first row.
+  uint8_t block[BLOCK_WIDTH * BLOCK_HEIGHT];
+  uint8_t num_bits_for_next_row = (bt == BLOCK_DELTA_ROW) ? 8u : num_bits;
+  for (int32_t row = 0; row < block_h; ++row) {
+    if (packed_end - packed < packed_row_size(num_bits_for_next_row)) {
+      throw std::runtime_error("Packed frame data overflow");
+    }
+    uint8_t deltas[BLOCK_WIDTH];
+    unpack_row(num_bits_for_next_row, packed, deltas);
+
+    uint8_t* dst = &block[row * BLOCK_WIDTH];
+    if (bt == BLOCK_DELTA_FRAME) {
+      const uint8_t* ref =
+          &delta_img[((y + row + motion_dy) * delta_img.stride()) + (x + motion_dx)];
+      for (int32_t i = 0; i < block_w; ++i) {
+        dst[i] = ref[i] + deltas[i];
+      }
+    } else if (bt == BLOCK_DELTA_ROW && row > 0) {
+      const uint8_t* ref = dst - BLOCK_WIDTH;
+      for (int32_t i = 0; i < block_w; ++i) {
+        dst[i] = ref[i] + deltas[i];
+      }
+    } else {
+      std::memcpy(dst, deltas, static_cast<size_t>(block_w));
+    }
+
+    num_bits_for_next_row = num_bits;
+  }
+
+  // Store the block in the reference frame (unless the frame is never referenced). Together with
+  // the output below, each row of a referenced block is copied twice: Into the internal reference
+  // frame and into the caller provided buffer.
+  if (store_reference_) {
+    image& img = refs.current();
+    for (int32_t row = 0; row < block_h; ++row) {
+      std::memcpy(&img[((y + row) * img.stride()) + x],
+                  &block[row * BLOCK_WIDTH],
+                  static_cast<size_t>(block_w));
+    }
+    stats_.reference_bytes += static_cast<int64_t>(block_w) * block_h;
+  }
+
+  // Update the filter image the same way as the encoder does.
+  if (use_filter) {
+    stats_.filter_bytes += static_cast<int64_t>(block_w) * block_h;
+    if (has_motion) {
+      uint8_t filtered_block[BLOCK_WIDTH * BLOCK_HEIGHT];
+      for (int32_t row = 0; row < block_h; ++row) {
+        const uint8_t* src1 =
+            &filter_image[((y + row + motion_dy) * filter_image.stride()) + (x + motion_dx)];
+        const uint8_t* src2 = &block[row * BLOCK_WIDTH];
+        uint8_t* dst = &filtered_block[row * BLOCK_WIDTH];
+        for (int32_t i = 0; i < block_w; ++i) {
+          const uint32_t c1 = static_cast<uint32_t>(src1[i]);
+          const uint32_t c2 = static_cast<uint32_t>(src2[i]);
+          dst[i] = static_cast<uint8_t>(((c1 * 3) + c2) >> 2);
+        }
+      }
+      for (int32_t row = 0; row < block_h; ++row) {
+        std::memcpy(&filter_image[((y + row) * filter_image.stride()) + x],
+                    &filtered_block[row * BLOCK_WIDTH],
+                    static_cast<size_t>(block_w));
+      }
+    } else {
+      for (int32_t row = 0; row < block_h; ++row) {
+        std::memcpy(&filter_image[((y + row) * filter_image.stride()) + x],
+                    &block[row * BLOCK_WIDTH],
+                    static_cast<size_t>(block_w));
+      }
+    }
+  }
+
+  // Write (or downscale) the block to the caller provided buffer while it is still in the cache.
+  write_output(block, BLOCK_WIDTH, x, y, block_w, block_h, pixels, stride);
+}
+}  // namespace lomc
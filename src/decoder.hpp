@@ -0,0 +1,154 @@
+#ifndef DECODER_HPP_
+#define DECODER_HPP_
+
+#include "format.hpp"
+#include "reference_frames.hpp"
+
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+
+namespace lomc {
+// The number of pixel bytes that the decoder has written so far, for measuring how many times each
+// pixel is copied.
+struct decode_stats {
+  int64_t output_bytes = 0;     // Written to the caller provided buffers.
+  int64_t reference_bytes = 0;  // Written to the internal reference frames.
+  int64_t filter_bytes = 0;     // Written to the internal filter images (including copies).
+};
+
+class decoder {
+public:
+  static const int32_t MAX_OUTPUT_SCALE_SHIFT = 3;
+
+  explicit decoder(const std::string& file_name);
+
+  // Decode the next frame directly into a caller provided buffer, which must hold
+  // output_height() rows of at least output_width() pixels each, stride bytes apart. Returns false
+  // if there are no more frames. Only for single plane (gray) files.
+  bool decode_frame(uint8_t* pixels, const int32_t stride);
+
+  // Decode the next frame into one caller provided buffer per plane, with the dimensions given by
+  // output_width(plane) and output_height(plane).
+  bool decode_frame(uint8_t* const* planes, const int32_t* strides);
+
+  // Only decode frames in temporal layers up to (and including) max_layer. The frames in the
+  // upper layers are skipped without being decoded. The max layer can be lowered at any time, but
+  // raising it takes effect at the next base layer frame.
+  void set_max_temporal_layer(const int32_t max_layer);
+
+  // Downscale the output by 2^scale_shift (0 to MAX_OUTPUT_SCALE_SHIFT) in both directions, e.g.
+  // for thumbnails. The downscaling is done block by block as part of the decoding.
+  //
+  // This only saves writing (and consuming) the full resolution output, since the format can not
+  // be decoded at a lower resolution: Every frame that is referenced by a later decoded frame is
+  // still reconstructed at full resolution, which is every frame but the last one with a single
+  // temporal layer. A large speedup requires dropping temporal layers as well (see
+  // set_max_temporal_layer()).
+  void set_output_scale(const int32_t scale_shift);
+
+  int32_t output_width(const int32_t plane = 0) const {
+    return (plane_size(width_, format_, plane) + (1 << scale_shift_) - 1) >> scale_shift_;
+  }
+
+  int32_t output_height(const int32_t plane = 0) const {
+    return (plane_size(height_, format_, plane) + (1 << scale_shift_) - 1) >> scale_shift_;
+  }
+
+  // The number of the most recently decoded frame.
+  int32_t frame_no() const {
+    return frame_no_ - 1;
+  }
+
+  int32_t num_temporal_layers() const {
+    return num_layers_;
+  }
+
+  int32_t width() const {
+    return width_;
+  }
+
+  int32_t height() const {
+    return height_;
+  }
+
+  int32_t num_frames() const {
+    return num_frames_;
+  }
+
+  pixel_format format() const {
+    return format_;
+  }
+
+  int32_t num_planes() const {
+    return lomc::num_planes(format_);
+  }
+
+  const decode_stats& stats() const {
+    return stats_;
+  }
+
+private:
+  void decode_plane(reference_frames& refs,
+                    const uint8_t* control,
+                    const uint8_t* control_end,
+                    const uint8_t* packed_end,
+                    uint8_t* pixels,
+                    const int32_t stride);
+  void decode_block(reference_frames& refs,
+                    const int32_t x,
+                    const int32_t y,
+                    const int32_t block_w,
+                    const int32_t block_h,
+                    const uint8_t control_byte,
+                    const uint8_t*& packed,
+                    const uint8_t* packed_end,
+                    uint8_t* pixels,
+                    const int32_t stride);
+  void skip_blocks(reference_frames& refs,
+                   const int32_t x,
+                   const int32_t y,
+                   const int32_t span_w,
+                   const int32_t block_h,
+                   uint8_t* pixels,
+                   const int32_t stride);
+  void write_output(const image& img,
+                    const int32_t x,
+                    const int32_t y,
+                    const int32_t w,
+                    const int32_t h,
+                    uint8_t* pixels,
+                    const int32_t stride);
+  void write_output(const uint8_t* src,
+                    const int32_t src_stride,
+                    const int32_t x,
+                    const int32_t y,
+                    const int32_t w,
+                    const int32_t h,
+                    uint8_t* pixels,
+                    const int32_t stride);
+  bool is_referenced_later(const int32_t layer) const;
+  bool read_frame(uint8_t& frame_flags);
+
+  std::ifstream file_;
+  int32_t width_;
+  int32_t height_;
+  int32_t num_frames_;
+  uint32_t flags_;
+  pixel_format format_;
+  int32_t num_layers_;
+  int32_t max_layer_;
+  int32_t requested_max_layer_;
+  int32_t scale_shift_;
+  bool store_reference_;  // The current frame is referenced by a later decoded frame.
+  int32_t frame_no_;
+  decode_stats stats_;
+
+  std::vector<uint8_t> packed_frame_data_;
+
+  std::vector<reference_frames> refs_;  // One per plane.
+};
+}  // namespace lomc
+
+#endif  // DECODER_HPP_
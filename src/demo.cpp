@@ -1,18 +1,32 @@
+#include "format.hpp"
 #include "image.hpp"
+#include "packbits.hpp"
+#include "reference_frames.hpp"
+#include "yuv_reader.hpp"
 
 #include <algorithm>
 #include <cassert>
+#include <chrono>
 #include <cstdint>
+#include <cstdlib>
 #include <cstring>
 #include <fstream>
 #include <iomanip>
 #include <iostream>
+#include <memory>
 #include <stdexcept>
 #include <sstream>
+#include <string>
+#include <thread>
 #include <vector>
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 #define ENABLE_MOTION_COMPENSATION
 #define ENABLE_FILTER
+#define ENABLE_PLANE_THREADS
 
 #ifndef NDEBUG
 #define DEBUG_EXPORT_DELTA_IMAGE
@@ -22,19 +36,24 @@
 #endif  // ENABLE_FILTER
 #endif  // NDEBUG
 
-namespace {
-const int32_t BLOCK_WIDTH = 16;
-const int32_t BLOCK_HEIGHT = 8;
-const int32_t FRAMES_BETWEEN_FORCED_KEY_BLOCK = 32;
-
-const int32_t MOTION_DELTA_MIN = -8;
-const int32_t MOTION_DELTA_MAX = 7;
-
-enum block_type { BLOCK_DELTA_FRAME = 0, BLOCK_DELTA_ROW = 1, BLOCK_COPY = 2 };
+// Print the time spent in each stage of the block pipeline. This is always done in debug builds,
+// and can be enabled in optimized builds with the LOMC_PRINT_TIMING CMake option.
+#if !defined(NDEBUG) && !defined(PRINT_TIMING)
+#define PRINT_TIMING
+#endif
 
-int32_t round_up(const int32_t x, const int32_t round_to) {
-  return round_to * ((x + round_to - 1) / round_to);
-}
+namespace {
+using lomc::BLOCK_WIDTH;
+using lomc::BLOCK_HEIGHT;
+using lomc::FRAMES_BETWEEN_FORCED_KEY_BLOCK;
+using lomc::MAX_CONTROL_RUN;
+using lomc::MOTION_DELTA_MIN;
+using lomc::MOTION_DELTA_MAX;
+using lomc::block_type;
+using lomc::BLOCK_DELTA_FRAME;
+using lomc::BLOCK_DELTA_ROW;
+using lomc::BLOCK_COPY;
+using lomc::round_up;
 
 #if 0
 uint8_t required_bits_old(const int32_t max_delta, const int32_t min_delta) {
@@ -67,211 +86,116 @@ uint8_t required_bits(const uint32_t max_neg_delta, const uint32_t max_pos_delta
   return num_bits;
 }
 
-uint8_t get_value_offset(const uint8_t num_bits) {
-  static const uint8_t value_offset_tab[9] = {0u, 1u, 2u, 0u, 8u, 0u, 0u, 0u, 0u};
-  return value_offset_tab[num_bits];
-}
-
-void apply_offset(const uint8_t num_bits, uint8_t* unpacked) {
-  const uint8_t offset = get_value_offset(num_bits);
-  if (offset > 0u) {
-    for (int i = 0; i < 16; ++i) {
-      unpacked[i] += offset;
-      if (num_bits < 8u && (unpacked[i] & 0x80u)) {
-        std::flush(std::cout);
-        throw std::runtime_error("WTF?!");
-      }
-    }
-  }
-}
-
-void packbits_1(const uint8_t* unpacked, uint8_t*& packed) {
-  // Read 16 bytes.
-  const uint32_t* src = reinterpret_cast<const uint32_t*>(unpacked);
-  uint32_t s1 = src[0];
-  uint32_t s2 = src[1];
-  uint32_t s3 = src[2];
-  uint32_t s4 = src[3];
-
-  // Combine into a single 16-bit word.
-  static const uint32_t mask1 = 0x01000000u;
-  static const uint32_t mask2 = 0x00010000u;
-  static const uint32_t mask3 = 0x00000100u;
-  static const uint32_t mask4 = 0x00000001u;
-  uint32_t d = ((s1 & mask1) >> 9) | ((s1 & mask2) >> 2) | ((s1 & mask3) << 5) |
-               ((s1 & mask4) << 12) | ((s2 & mask1) >> 13) | ((s2 & mask2) >> 8) |
-               ((s2 & mask3) << 1) | ((s2 & mask4) << 8) | ((s3 & mask1) >> 17) |
-               ((s3 & mask2) >> 10) | ((s3 & mask3) >> 3) | ((s3 & mask4) << 4) |
-               ((s4 & mask1) >> 21) | ((s4 & mask2) >> 14) | ((s4 & mask3) >> 7) | (s4 & mask4);
-
-  // Write 2 bytes.
-  uint16_t* dst = reinterpret_cast<uint16_t*>(packed);
-  dst[0] = static_cast<uint16_t>(d);
-  packed += 2;
-}
-
-void packbits_2(const uint8_t* unpacked, uint8_t*& packed) {
-  // Read 16 bytes.
-  const uint32_t* src = reinterpret_cast<const uint32_t*>(unpacked);
-  uint32_t s1 = src[0];
-  uint32_t s2 = src[1];
-  uint32_t s3 = src[2];
-  uint32_t s4 = src[3];
-
-  // Combine into a single 32-bit word.
-  static const uint32_t mask1 = 0x03000000u;
-  static const uint32_t mask2 = 0x00030000u;
-  static const uint32_t mask3 = 0x00000300u;
-  static const uint32_t mask4 = 0x00000003u;
-  uint32_t d = ((s1 & mask1) << 6) | ((s1 & mask2) << 12) | ((s1 & mask3) << 18) |
-               ((s1 & mask4) << 24) | ((s2 & mask1) >> 2) | ((s2 & mask2) << 4) |
-               ((s2 & mask3) << 10) | ((s2 & mask4) << 16) | ((s3 & mask1) >> 10) |
-               ((s3 & mask2) >> 4) | ((s3 & mask3) << 2) | ((s3 & mask4) << 8) |
-               ((s4 & mask1) >> 18) | ((s4 & mask2) >> 12) | ((s4 & mask3) >> 6) | (s4 & mask4);
-
-  // Write 4 bytes.
-  uint32_t* dst = reinterpret_cast<uint32_t*>(packed);
-  dst[0] = d;
-  packed += 4;
-}
-
-void packbits_4(const uint8_t* unpacked, uint8_t*& packed) {
-  // Read 16 bytes.
-  const uint32_t* src = reinterpret_cast<const uint32_t*>(unpacked);
-  uint32_t s1 = src[0];
-  uint32_t s2 = src[1];
-  uint32_t s3 = src[2];
-  uint32_t s4 = src[3];
-
-  // Combine into two 32-bit words.
-  static const uint32_t mask1 = 0x0f000000u;
-  static const uint32_t mask2 = 0x000f0000u;
-  static const uint32_t mask3 = 0x00000f00u;
-  static const uint32_t mask4 = 0x0000000fu;
-  uint32_t d1 = ((s1 & mask1) << 4) | ((s1 & mask2) << 8) | ((s1 & mask3) << 12) |
-                ((s1 & mask4) << 16) | ((s2 & mask1) >> 12) | ((s2 & mask2) >> 8) |
-                ((s2 & mask3) >> 4) | (s2 & mask4);
-  uint32_t d2 = ((s3 & mask1) << 4) | ((s3 & mask2) << 8) | ((s3 & mask3) << 12) |
-                ((s3 & mask4) << 16) | ((s4 & mask1) >> 12) | ((s4 & mask2) >> 8) |
-                ((s4 & mask3) >> 4) | (s4 & mask4);
-
-  // Write 8 bytes.
-  uint32_t* dst = reinterpret_cast<uint32_t*>(packed);
-  dst[0] = d1;
-  dst[1] = d2;
-  packed += 8;
-}
-
-void packbits_8(const uint8_t* unpacked, uint8_t*& packed) {
-  // Copy 16 bytes.
-  const uint32_t* src = reinterpret_cast<const uint32_t*>(unpacked);
-  uint32_t* dst = reinterpret_cast<uint32_t*>(packed);
-  dst[0] = src[0];
-  dst[1] = src[1];
-  dst[2] = src[2];
-  dst[3] = src[3];
-  packed += 16;
-}
-
-void unpackbits_1(const uint8_t*& packed, uint8_t* unpacked) {
-  // Read 2 bytes.
-  const uint16_t* src = reinterpret_cast<const uint16_t*>(packed);
-  uint32_t s1 = static_cast<uint32_t>(src[0]);
-  packed += 2;
-
-  // Split into four 32-bit words.
-  // TODO(m): Implement me!
-  uint32_t d1 = s1;
-  uint32_t d2 = s1;
-  uint32_t d3 = s1;
-  uint32_t d4 = s1;
-
-  // Write 16 bytes.
-  uint32_t* dst = reinterpret_cast<uint32_t*>(unpacked);
-  dst[0] = d1;
-  dst[1] = d2;
-  dst[2] = d3;
-  dst[3] = d4;
-}
-
-void unpackbits_2(const uint8_t*& packed, uint8_t* unpacked) {
-  // Read 4 bytes.
-  const uint32_t* src = reinterpret_cast<const uint32_t*>(packed);
-  uint32_t s1 = src[0];
-  packed += 4;
-
-  // Split into four 32-bit words.
-  // TODO(m): Implement me!
-  uint32_t d1 = s1;
-  uint32_t d2 = s1;
-  uint32_t d3 = s1;
-  uint32_t d4 = s1;
-
-  // Write 16 bytes.
-  uint32_t* dst = reinterpret_cast<uint32_t*>(unpacked);
-  dst[0] = d1;
-  dst[1] = d2;
-  dst[2] = d3;
-  dst[3] = d4;
-}
-
-void unpackbits_4(const uint8_t*& packed, uint8_t* unpacked) {
-  // Read 8 bytes.
-  const uint32_t* src = reinterpret_cast<const uint32_t*>(packed);
-  uint32_t s1 = src[0];
-  uint32_t s2 = src[1];
-  packed += 8;
-
-  // Split into four 32-bit words.
-  // TODO(m): Implement me!
-  uint32_t d1 = s1;
-  uint32_t d2 = s2;
-  uint32_t d3 = s1;
-  uint32_t d4 = s2;
-
-  // Write 16 bytes.
-  uint32_t* dst = reinterpret_cast<uint32_t*>(unpacked);
-  dst[0] = d1;
-  dst[1] = d2;
-  dst[2] = d3;
-  dst[3] = d4;
-}
-
-void unpackbits_8(const uint8_t*& packed, uint8_t* unpacked) {
-  // Copy 16 bytes.
-  const uint32_t* src = reinterpret_cast<const uint32_t*>(packed);
-  uint32_t* dst = reinterpret_cast<uint32_t*>(unpacked);
-  dst[0] = src[0];
-  dst[1] = src[1];
-  dst[2] = src[2];
-  dst[3] = src[3];
-  packed += 16;
-}
-
 int32_t match_score(const uint8_t* src1,
                     const uint8_t* src2,
                     const int32_t width,
                     const int32_t height,
-                    const int32_t stride) {
+                    const int32_t src1_stride,
+                    const int32_t src2_stride) {
   int32_t score = 0U;
   for (int32_t y = 0; y < height; ++y) {
     for (int32_t x = 0; x < width; ++x) {
       const int32_t delta = static_cast<int32_t>(src2[x]) - static_cast<int32_t>(src1[x]);
       score += delta * delta;
     }
-    src1 += stride;
-    src2 += stride;
+    src1 += src1_stride;
+    src2 += src2_stride;
   }
   return score;
 }
 
+#if defined(__SSE2__)
+uint8_t horizontal_max_epu8(__m128i x) {
+  x = _mm_max_epu8(x, _mm_srli_si128(x, 8));
+  x = _mm_max_epu8(x, _mm_srli_si128(x, 4));
+  x = _mm_max_epu8(x, _mm_srli_si128(x, 2));
+  x = _mm_max_epu8(x, _mm_srli_si128(x, 1));
+  return static_cast<uint8_t>(_mm_cvtsi128_si32(x));
+}
+
+uint8_t horizontal_min_epu8(__m128i x) {
+  x = _mm_min_epu8(x, _mm_srli_si128(x, 8));
+  x = _mm_min_epu8(x, _mm_srli_si128(x, 4));
+  x = _mm_min_epu8(x, _mm_srli_si128(x, 2));
+  x = _mm_min_epu8(x, _mm_srli_si128(x, 1));
+  return static_cast<uint8_t>(_mm_cvtsi128_si32(x));
+}
+
+// SSE2 version of block_frame_delta() for full width blocks (one row = one 16-byte vector).
+void block_frame_delta_sse2(const uint8_t* src1,
+                            const uint8_t* src2,
+                            const int32_t height,
+                            const int32_t src1_stride,
+                            const int32_t src2_stride,
+                            uint8_t* dst,
+                            uint8_t* filtered,
+                            uint8_t& num_bits) {
+  static_assert(BLOCK_WIDTH == 16, "The SSE2 code path requires 16 pixel wide blocks");
+
+  // The signed deltas are tracked as unsigned bytes with the sign bit flipped (i.e. biased by
+  // 128), since SSE2 only has unsigned byte min/max.
+  const __m128i sign_bit = _mm_set1_epi8(static_cast<char>(0x80));
+  const __m128i zero = _mm_setzero_si128();
+  __m128i max_biased = zero;
+  __m128i min_biased = _mm_set1_epi8(static_cast<char>(0xff));
+
+  for (int32_t y = 0; y < height; ++y) {
+    const __m128i c1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src1));
+    const __m128i c2 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src2));
+
+    // Delta to the previous image.
+    const __m128i delta = _mm_sub_epi8(c2, c1);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(dst), delta);
+    const __m128i biased = _mm_xor_si128(delta, sign_bit);
+    max_biased = _mm_max_epu8(max_biased, biased);
+    min_biased = _mm_min_epu8(min_biased, biased);
+
+    // Filtered pixels: ((c1 * 3) + c2) >> 2, calculated with 16-bit precision.
+    if (filtered != nullptr) {
+      const __m128i c1_lo = _mm_unpacklo_epi8(c1, zero);
+      const __m128i c1_hi = _mm_unpackhi_epi8(c1, zero);
+      const __m128i c2_lo = _mm_unpacklo_epi8(c2, zero);
+      const __m128i c2_hi = _mm_unpackhi_epi8(c2, zero);
+      const __m128i f_lo = _mm_srli_epi16(
+          _mm_add_epi16(_mm_add_epi16(_mm_slli_epi16(c1_lo, 1), c1_lo), c2_lo), 2);
+      const __m128i f_hi = _mm_srli_epi16(
+          _mm_add_epi16(_mm_add_epi16(_mm_slli_epi16(c1_hi, 1), c1_hi), c2_hi), 2);
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(filtered), _mm_packus_epi16(f_lo, f_hi));
+      filtered += BLOCK_WIDTH;
+    }
+
+    src1 += src1_stride;
+    src2 += src2_stride;
+    dst += BLOCK_WIDTH;
+  }
+
+  const int32_t max_delta = static_cast<int32_t>(horizontal_max_epu8(max_biased)) - 128;
+  const int32_t min_delta = static_cast<int32_t>(horizontal_min_epu8(min_biased)) - 128;
+  const uint32_t max_pos_delta = static_cast<uint32_t>(std::max(max_delta, 0));
+  const uint32_t max_neg_delta = static_cast<uint32_t>(min_delta < 0 ? 256 + min_delta : 256);
+  num_bits = required_bits(max_neg_delta, max_pos_delta);
+}
+#endif
+
+// Calculate the delta between src2 and the reference block src1. If filtered is non-null, the
+// temporally filtered block ((src1 * 3 + src2) / 4) is produced in the same pass and stored with a
+// stride of BLOCK_WIDTH.
 void block_frame_delta(const uint8_t* src1,
                        const uint8_t* src2,
                        const int32_t width,
                        const int32_t height,
-                       const int32_t src_stride,
+                       const int32_t src1_stride,
+                       const int32_t src2_stride,
                        uint8_t* dst,
+                       uint8_t* filtered,
                        uint8_t& num_bits) {
+#if defined(__SSE2__)
+  if (width == BLOCK_WIDTH) {
+    block_frame_delta_sse2(src1, src2, height, src1_stride, src2_stride, dst, filtered, num_bits);
+    return;
+  }
+#endif
+
   uint32_t max_pos_delta = 0u;
   uint32_t max_neg_delta = 256u;
 
@@ -286,8 +210,16 @@ void block_frame_delta(const uint8_t* src1,
         max_pos_delta = std::max(max_pos_delta, static_cast<uint32_t>(delta));
       }
     }
-    src1 += src_stride;
-    src2 += src_stride;
+    if (filtered != nullptr) {
+      for (int32_t x = 0; x < width; ++x) {
+        const uint32_t c1 = static_cast<uint32_t>(src1[x]);
+        const uint32_t c2 = static_cast<uint32_t>(src2[x]);
+        filtered[x] = static_cast<uint8_t>(((c1 * 3) + c2) >> 2);
+      }
+      filtered += BLOCK_WIDTH;
+    }
+    src1 += src1_stride;
+    src2 += src2_stride;
     dst += BLOCK_WIDTH;
   }
 
@@ -381,359 +313,1623 @@ void block_copy(const uint8_t* src,
   num_bits = 8u;
 }
 
-void pack_int32(const int32_t x, uint8_t* data) {
-  data[0] = static_cast<uint8_t>(x);
-  data[1] = static_cast<uint8_t>(x >> 8);
-  data[2] = static_cast<uint8_t>(x >> 16);
-  data[3] = static_cast<uint8_t>(x >> 24);
+void copy_block(const uint8_t* src,
+                const int32_t src_stride,
+                const int32_t width,
+                const int32_t height,
+                uint8_t* dst,
+                const int32_t dst_stride) {
+  for (int32_t y = 0; y < height; ++y) {
+    std::memcpy(dst, src, static_cast<size_t>(width));
+    src += src_stride;
+    dst += dst_stride;
+  }
+}
+
+// Near-lossless coding: A delta may be clamped to fit in fewer bits, as long as the reconstructed
+// pixel stays within an error bound of the input pixel. The decoder is unaffected, since it simply
+// reconstructs whatever deltas it is given.
+const uint8_t NUM_BITS_CHOICES[] = {0u, 1u, 2u, 4u, 8u};
+
+// The range of deltas that can be coded with the given number of bits (see required_bits()).
+void delta_range(const uint8_t num_bits, int32_t& min_delta, int32_t& max_delta) {
+  min_delta = (num_bits > 0u) ? -((1 << num_bits) >> 1) : 0;
+  max_delta = (num_bits > 0u) ? ((1 << num_bits) >> 1) - 1 : 0;
+}
+
+// Clamp the delta between a pixel and its prediction to the given range. Returns false if the
+// reconstructed pixel differs from the input pixel by more than error_bound.
+bool near_lossless_delta(const uint8_t pixel,
+                         const uint8_t predicted,
+                         const int32_t min_delta,
+                         const int32_t max_delta,
+                         const int32_t error_bound,
+                         uint8_t& delta,
+                         uint8_t& reconstructed) {
+  const int32_t exact_delta = static_cast<int8_t>(static_cast<uint8_t>(pixel - predicted));
+  const int32_t clamped_delta = std::max(min_delta, std::min(exact_delta, max_delta));
+  delta = static_cast<uint8_t>(clamped_delta);
+  reconstructed = static_cast<uint8_t>(predicted + delta);
+  return std::abs(static_cast<int32_t>(pixel) - static_cast<int32_t>(reconstructed)) <=
+         error_bound;
+}
+
+// Near-lossless version of block_frame_delta(). The smallest number of bits for which all the
+// pixels are within error_bound is selected, and the reconstructed block is stored with a stride
+// of BLOCK_WIDTH.
+void block_frame_delta_near_lossless(const uint8_t* src1,
+                                     const uint8_t* src2,
+                                     const int32_t width,
+                                     const int32_t height,
+                                     const int32_t src1_stride,
+                                     const int32_t src2_stride,
+                                     const int32_t error_bound,
+                                     uint8_t* dst,
+                                     uint8_t* reconstructed,
+                                     uint8_t& num_bits) {
+  num_bits = 8u;
+  for (const uint8_t bits : NUM_BITS_CHOICES) {
+    int32_t min_delta;
+    int32_t max_delta;
+    delta_range(bits, min_delta, max_delta);
+    bool ok = true;
+    for (int32_t y = 0; y < height && ok; ++y) {
+      for (int32_t x = 0; x < width && ok; ++x) {
+        ok = near_lossless_delta(src2[(y * src2_stride) + x],
+                                 src1[(y * src1_stride) + x],
+                                 min_delta,
+                                 max_delta,
+                                 error_bound,
+                                 dst[(y * BLOCK_WIDTH) + x],
+                                 reconstructed[(y * BLOCK_WIDTH) + x]);
+      }
+    }
+    if (ok) {
+      num_bits = bits;
+      return;
+    }
+  }
+}
+
+// Near-lossless version of block_row_delta(). Each row is predicted from the reconstructed
+// previous row, so that the error does not accumulate down the block.
+void block_row_delta_near_lossless(const uint8_t* src,
+                                   const int32_t width,
+                                   const int32_t height,
+                                   const int32_t src_stride,
+                                   const int32_t error_bound,
+                                   uint8_t* dst,
+                                   uint8_t* reconstructed,
+                                   uint8_t& num_bits) {
+  num_bits = 8u;
+  // The first row is a raw copy.
+  std::memcpy(dst, src, static_cast<size_t>(width));
+  std::memcpy(reconstructed, src, static_cast<size_t>(width));
+
+  for (const uint8_t bits : NUM_BITS_CHOICES) {
+    int32_t min_delta;
+    int32_t max_delta;
+    delta_range(bits, min_delta, max_delta);
+    bool ok = true;
+    for (int32_t y = 1; y < height && ok; ++y) {
+      for (int32_t x = 0; x < width && ok; ++x) {
+        ok = near_lossless_delta(src[(y * src_stride) + x],
+                                 reconstructed[((y - 1) * BLOCK_WIDTH) + x],
+                                 min_delta,
+                                 max_delta,
+                                 error_bound,
+                                 dst[(y * BLOCK_WIDTH) + x],
+                                 reconstructed[(y * BLOCK_WIDTH) + x]);
+      }
+    }
+    if (ok) {
+      num_bits = bits;
+      return;
+    }
+  }
+}
+
+bool same_block(const lomc::image& img1,
+                const lomc::image& img2,
+                const int32_t x,
+                const int32_t y,
+                const int32_t width,
+                const int32_t height) {
+  for (int32_t i = y; i < y + height; ++i) {
+    if (std::memcmp(&img1[(i * img1.stride()) + x],
+                    &img2[(i * img2.stride()) + x],
+                    static_cast<size_t>(width)) != 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+#ifdef PRINT_TIMING
+// Accumulated time (in seconds) spent in the different stages of the block pipeline. The temporal
+// pre-filter blend is fused into the frame delta (see block_frame_delta()), so it is included in
+// the residual time. The filter time only covers storing the filtered block in the filter image.
+struct stage_times {
+  double motion_search = 0.0;
+  double residual = 0.0;  // Including the filter blend.
+  double filter = 0.0;    // Filter image update.
+  double packing = 0.0;
+
+  void operator+=(const stage_times& other) {
+    motion_search += other.motion_search;
+    residual += other.residual;
+    filter += other.filter;
+    packing += other.packing;
+  }
+
+  void print(const char* title) const {
+    std::cout << title << " (ms): motion search " << (1000.0 * motion_search) << ", residual "
+              << (1000.0 * residual) << " (incl. filter blend), filter update "
+              << (1000.0 * filter) << ", packing " << (1000.0 * packing) << "\n";
+  }
+};
+
+class stage_clock {
+public:
+  void restart() {
+    last_ = std::chrono::steady_clock::now();
+  }
+
+  // Add the time since the last restart/lap to the given stage time.
+  void lap(double& stage_time) {
+    const std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    stage_time += std::chrono::duration<double>(now - last_).count();
+    last_ = now;
+  }
+
+private:
+  std::chrono::steady_clock::time_point last_;
+};
+#endif
+
+// Run-length code the control bytes of a frame. Returns the packed size.
+int32_t pack_control_data(const uint8_t* control_data, const int32_t num_blocks, uint8_t* packed) {
+  uint8_t* dst = packed;
+  int32_t block_no = 0;
+  while (block_no < num_blocks) {
+    const uint8_t control_byte = control_data[block_no];
+    int32_t run_length = 1;
+    while ((block_no + run_length) < num_blocks && run_length < lomc::MAX_CONTROL_RUN &&
+           control_data[block_no + run_length] == control_byte) {
+      ++run_length;
+    }
+    if (run_length >= lomc::MIN_CONTROL_RUN) {
+      *dst++ = control_byte | lomc::CONTROL_RUN;
+      *dst++ = static_cast<uint8_t>(run_length - lomc::MIN_CONTROL_RUN);
+    } else {
+      *dst++ = control_byte;
+    }
+    block_no += run_length;
+  }
+  return static_cast<int32_t>(dst - packed);
+}
+
+void write_frame_header(const int32_t packed_frame_size, const uint8_t frame_flags, uint8_t* data) {
+  lomc::pack_int32(packed_frame_size, &data[0]);
+  data[4] = frame_flags;
 }
 
 void write_header(const int32_t num_images,
                   const int32_t width,
                   const int32_t height,
+                  const uint32_t flags,
                   std::ofstream& packed_file) {
   // Signature.
-  packed_file << "LOMC\1";
+  packed_file << "LOMC" << static_cast<char>(lomc::FILE_VERSION);
 
   uint8_t x4[4];
 
   // Width.
-  pack_int32(width, x4);
+  lomc::pack_int32(width, x4);
   packed_file.write(reinterpret_cast<const char*>(x4), 4);
 
   // Height.
-  pack_int32(height, x4);
+  lomc::pack_int32(height, x4);
   packed_file.write(reinterpret_cast<const char*>(x4), 4);
 
   // Num images.
-  pack_int32(num_images, x4);
+  lomc::pack_int32(num_images, x4);
+  packed_file.write(reinterpret_cast<const char*>(x4), 4);
+
+  // Flags.
+  lomc::pack_int32(static_cast<int32_t>(flags), x4);
   packed_file.write(reinterpret_cast<const char*>(x4), 4);
 }
-}  // namespace
 
-int main(int argc, const char** argv) {
-  try {
-    const int32_t num_images = argc - 1;
-    if (num_images < 1) {
-      throw std::runtime_error("No input files provided.");
+#if defined(DEBUG_EXPORT_DELTA_IMAGE) || defined(DEBUG_EXPORT_FILTERED_IMAGE)
+std::string debug_file_name(const char* prefix, const int32_t img_no, const int32_t plane) {
+  static const char plane_names[] = {'y', 'u', 'v'};
+  std::ostringstream file_name;
+  file_name << prefix << std::setfill('0') << std::setw(4) << img_no;
+  if (plane > 0) {
+    file_name << "_" << plane_names[plane];
+  }
+  file_name << ".pgm";
+  return file_name.str();
+}
+#endif
+
+// A motion vector for a block of the luma plane (or the only plane).
+struct motion_vector {
+  int32_t dx = 0;
+  int32_t dy = 0;
+  int32_t error = 0;      // Match score for the motion compensated block.
+  bool is_match = false;  // The match is good enough to use.
+};
+
+// Could we find a good enough match?
+const int32_t ERROR_THRESHOLD = (BLOCK_HEIGHT * BLOCK_WIDTH) * (20 * 20);
+
+// Find the best matching block in the reference frame for each block of the image. Blocks that
+// are known to be unchanged since the reference frame (clean blocks) are not searched.
+void motion_search(const lomc::image& img,
+                   const lomc::image& ref_img,
+                   const std::vector<uint8_t>& clean_blocks,
+                   std::vector<motion_vector>& vectors) {
+  int32_t block_no = 0;
+  for (int32_t y = 0; y < img.height(); y += BLOCK_HEIGHT) {
+    const int32_t block_h = std::min(BLOCK_HEIGHT, img.height() - y);
+    for (int32_t x = 0; x < img.width(); x += BLOCK_WIDTH) {
+      const int32_t block_w = std::min(BLOCK_WIDTH, img.width() - x);
+      const bool is_clean = clean_blocks[static_cast<size_t>(block_no)] != 0u;
+      motion_vector& mv = vectors[static_cast<size_t>(block_no++)];
+      if (is_clean) {
+        mv = motion_vector();
+#if defined(DEBUG_PRINT_INFO)
+        std::cout << ' ';
+#endif
+        continue;
+      }
+
+      const int32_t min_x_offset = std::max(MOTION_DELTA_MIN, -x);
+      const int32_t max_x_offset = std::min(MOTION_DELTA_MAX, img.width() - block_w - x);
+      const int32_t min_y_offset = std::max(MOTION_DELTA_MIN, -y);
+      const int32_t max_y_offset = std::min(MOTION_DELTA_MAX, img.height() - block_h - y);
+      int32_t min_error = 0x7fffffffu;
+      int32_t min_offset = 0x7fffffffu;
+      int32_t motion_dx = 0;
+      int32_t motion_dy = 0;
+      for (int32_t dy = min_y_offset; dy <= max_y_offset; ++dy) {
+        for (int32_t dx = min_x_offset; dx <= max_x_offset; ++dx) {
+          int32_t error = match_score(&ref_img[((y + dy) * ref_img.stride()) + (x + dx)],
+                                      &img[(y * img.stride()) + x],
+                                      block_w,
+                                      block_h,
+                                      ref_img.stride(),
+                                      img.stride());
+          if (error <= min_error) {
+            int32_t offset = (dx * dx) + (dy * dy);
+            if ((error < min_error) || (offset < min_offset)) {
+              motion_dx = dx;
+              motion_dy = dy;
+              min_error = error;
+              min_offset = offset;
+            }
+          }
+        }
+      }
+
+      mv.is_match = (min_error <= ERROR_THRESHOLD);
+      mv.dx = mv.is_match ? motion_dx : 0;
+      mv.dy = mv.is_match ? motion_dy : 0;
+      mv.error = min_error;
+
+#if defined(DEBUG_PRINT_INFO)
+      {
+        static const char ascii_art[] = {'.', '-', '+', '*'};
+        int32_t d = (mv.dx * mv.dx) + (mv.dy * mv.dy);
+        d = ((d * 3) + 64) / 128;
+        assert(d < 4);
+        std::cout << ascii_art[d];
+      }
+#endif
     }
+#if defined(DEBUG_PRINT_INFO)
+    std::cout << "\n";
+#endif
+  }
+}
 
-    // Read the first image to detrmine the movie properties.
-    int32_t width;
-    int32_t height;
-    {
-      lomc::image first_img;
-      first_img.load(argv[1]);
-      width = first_img.width();
-      height = first_img.height();
+// Derive the motion vector for a block of a subsampled (chroma) plane from the co-located luma
+// block, instead of searching again. The match is re-checked against the plane itself.
+motion_vector scaled_motion_vector(const std::vector<motion_vector>& luma_vectors,
+                                   const int32_t luma_blocks_per_row,
+                                   const int32_t subsampling,
+                                   const lomc::image& img,
+                                   const lomc::image& ref_img,
+                                   const int32_t x,
+                                   const int32_t y,
+                                   const int32_t block_w,
+                                   const int32_t block_h) {
+  const int32_t luma_block_no = (((y << subsampling) / BLOCK_HEIGHT) * luma_blocks_per_row) +
+                                ((x << subsampling) / BLOCK_WIDTH);
+  const motion_vector& luma_mv = luma_vectors[static_cast<size_t>(luma_block_no)];
+  motion_vector mv;
+  if (!luma_mv.is_match) {
+    return mv;
+  }
+
+  const int32_t scale = 1 << subsampling;
+  const int32_t dx = std::max(-x, std::min(luma_mv.dx / scale, img.width() - block_w - x));
+  const int32_t dy = std::max(-y, std::min(luma_mv.dy / scale, img.height() - block_h - y));
+  mv.error = match_score(&ref_img[((y + dy) * ref_img.stride()) + (x + dx)],
+                         &img[(y * img.stride()) + x],
+                         block_w,
+                         block_h,
+                         ref_img.stride(),
+                         img.stride());
+  mv.is_match = (mv.error <= ERROR_THRESHOLD);
+  mv.dx = mv.is_match ? dx : 0;
+  mv.dy = mv.is_match ? dy : 0;
+  return mv;
+}
+
+// Incrementally calculated size of the run-length coded control bytes (see pack_control_data()).
+class control_size_counter {
+public:
+  int32_t size() const {
+    return size_;
+  }
+
+  // The number of bytes that would be added by the given control byte.
+  int32_t cost(const uint8_t control_byte) const {
+    if (continues_run(control_byte)) {
+      return (run_length_ == 1) ? 1 : 0;
     }
-    const int32_t out_stride = round_up(width, BLOCK_WIDTH);
-    const int32_t num_blocks =
-        ((width + BLOCK_WIDTH - 1) / BLOCK_WIDTH) * ((height + BLOCK_HEIGHT - 1) / BLOCK_HEIGHT);
+    return 1;
+  }
 
-#ifdef DEBUG_PRINT_INFO
-    std::cout << "Dimensions: " << width << "x" << height << "\n";
-    std::cout << "# frames: " << num_images << "\n";
-    std::cout << "# blocks / frame: " << num_blocks << "\n";
-#endif
+  void add(const uint8_t control_byte) {
+    size_ += cost(control_byte);
+    if (continues_run(control_byte)) {
+      ++run_length_;
+    } else {
+      last_control_byte_ = control_byte;
+      run_length_ = 1;
+    }
+  }
 
-    // Create the output file.
-    std::ofstream packed_file("packed.lmc", std::ios::out | std::ios::binary);
-    write_header(num_images, width, height, packed_file);
+private:
+  bool continues_run(const uint8_t control_byte) const {
+    return (run_length_ > 0) && (control_byte == last_control_byte_) &&
+           (run_length_ < MAX_CONTROL_RUN);
+  }
 
-    // Create a working buffer for packed data.
-    const int32_t control_data_size = round_up(num_blocks, BLOCK_WIDTH);
-    std::vector<uint8_t> packed_frame_data(
-        static_cast<size_t>(4 + control_data_size + (out_stride * height)));
+  int32_t size_ = 0;
+  int32_t run_length_ = 0;
+  uint8_t last_control_byte_ = 0u;
+};
+
+// Error bounds for near-lossless coding, selected by the rate control (level 0 is lossless).
+const int32_t ERROR_BOUNDS[] = {0, 1, 2, 3, 4, 6, 8, 12, 16, 24, 32};
+const int32_t MAX_ERROR_LEVEL =
+    static_cast<int32_t>(sizeof(ERROR_BOUNDS) / sizeof(ERROR_BOUNDS[0])) - 1;
+
+// A rectangle of the frame (in luma pixels) that has changed since the previous frame. Capture
+// sources such as compositors usually know these, so that the encoder can skip the rest.
+struct dirty_rect {
+  int32_t x = 0;
+  int32_t y = 0;
+  int32_t width = 0;
+  int32_t height = 0;
+};
+
+// Byte budget for a packed plane (excluding the plane header), set by the rate control.
+const int32_t NO_BUDGET = 0x7fffffff;
+struct plane_budget {
+  int32_t target_bytes = NO_BUDGET;  // Steer the error bound towards this size.
+  int32_t max_bytes = NO_BUDGET;     // Never exceed this size (except for the first frame).
+};
+
+// Encoder for a single plane of the frames. Each plane has its own block grid and output buffers,
+// so that the planes of a frame can be encoded concurrently.
+class plane_encoder {
+public:
+  // The key block period is given in input frames. Key blocks are only placed in base layer
+  // frames (one out of 2^(num_layers - 1) frames), so the period is converted to base layer frames
+  // in order to keep the same refresh interval with any number of temporal layers. It must be at
+  // least 2^(num_layers - 1).
+  plane_encoder(const int32_t plane,
+                const int32_t width,
+                const int32_t height,
+                const int32_t num_layers,
+                const int32_t key_block_period)
+      : plane_(plane),
+        num_layers_(num_layers),
+        key_block_period_(key_block_period >> (num_layers - 1)),
+        width_(width),
+        height_(height),
+        blocks_per_row_((width + BLOCK_WIDTH - 1) / BLOCK_WIDTH),
+        num_blocks_(lomc::blocks_per_frame(width, height)),
+        clean_blocks_(static_cast<size_t>(num_blocks_)),
+        skipped_blocks_(static_cast<size_t>(num_blocks_)),
+        min_ref_frame_no_(static_cast<size_t>(num_blocks_)),
+        has_dirty_rects_(false),
+        num_skipped_blocks_(0),
+        control_data_(static_cast<size_t>(num_blocks_)),
+        packed_control_data_(static_cast<size_t>(lomc::PLANE_HEADER_SIZE + num_blocks_)),
+        packed_block_data_(
+            static_cast<size_t>(num_blocks_ + (round_up(width, BLOCK_WIDTH) * height))),
+        packed_control_data_size_(0),
+        packed_block_data_size_(0),
+        total_bits_(0),
+        error_level_(0),
+        max_error_bound_(0),
+        num_dropped_blocks_(0),
+        num_key_blocks_(0) {
+  }
 
-#ifdef ENABLE_FILTER
-    lomc::image filter_image(width, height);
+  // Dirty rectangle hints for the next frame (in luma pixels): Only the blocks that intersect the
+  // rectangles may have changed since the previous frame. Without hints, all blocks of the frame
+  // are treated as changed.
+  void set_dirty_rects(const std::vector<dirty_rect>& dirty_rects) {
+    dirty_rects_ = dirty_rects;
+    has_dirty_rects_ = true;
+  }
+
+  // Find the blocks that are unchanged since the reference frame, given the dirty rectangles (if
+  // any) that were set for this frame.
+  void begin_frame(const int32_t img_no, const int32_t subsampling);
+
+  // One flag per block, set for the blocks that are unchanged since the reference frame.
+  const std::vector<uint8_t>& clean_blocks() const {
+    return clean_blocks_;
+  }
+
+  // Check if the blocks that may have changed are identical to the reference frame.
+  bool same_as_reference(const lomc::image& img, const lomc::image& ref_img) const;
+
+  // Treat all blocks as unchanged since the reference frame, for a frame that is identical to its
+  // reference frame but still has to carry forced key blocks.
+  void mark_all_clean() {
+    std::fill(clean_blocks_.begin(), clean_blocks_.end(), 1u);
+  }
+
+  // Every now and then we force each block to be encoded independently of the previous frame in
+  // order to be able to recover from frame losses and similar. From any given frame, it takes
+  // key_block_period_ base layer frames until a frame can be fully reconstructed. Key blocks are
+  // only placed in base layer frames (which all other frames depend on).
+  bool is_forced_key_block(const int32_t img_no,
+                           const int32_t layer,
+                           const int32_t block_no) const {
+    const int32_t base_frame_no = img_no >> (num_layers_ - 1);
+    return (layer == 0) && (((base_frame_no + block_no) % key_block_period_) == 0);
+  }
+
+  // The number of forced key blocks that are due in the given frame.
+  int32_t num_forced_key_blocks(const int32_t img_no, const int32_t layer) const {
+    if (layer != 0) {
+      return 0;
+    }
+    const int32_t base_frame_no = img_no >> (num_layers_ - 1);
+    const int32_t first_block_no =
+        (key_block_period_ - (base_frame_no % key_block_period_)) % key_block_period_;
+    return (first_block_no < num_blocks_)
+               ? ((num_blocks_ - first_block_no - 1) / key_block_period_) + 1
+               : 0;
+  }
+
+  // Encode a frame of the plane. The motion vectors are taken from the luma plane. With near-
+  // lossless coding, img is updated with the reconstructed pixels. The clean blocks (except for
+  // the forced key blocks) are coded as skip blocks without touching their pixels in img, until
+  // end_frame().
+  void encode(const int32_t img_no,
+              const int32_t layer,
+              lomc::image& img,
+              const lomc::image& ref_img,
+              lomc::image* filter_image,
+              const std::vector<motion_vector>& luma_vectors,
+              const int32_t luma_blocks_per_row,
+              const int32_t subsampling,
+              const plane_budget& budget);
+
+  // Store the frame (img) in the reference frames. See encode().
+  void end_frame(lomc::reference_frames& refs);
+
+  // Size of the packed plane (including the plane header).
+  int32_t packed_size() const {
+    return lomc::PLANE_HEADER_SIZE + packed_control_data_size_ + packed_block_data_size_;
+  }
+
+  void write(std::ofstream& packed_file) const {
+    packed_file.write(reinterpret_cast<const char*>(packed_control_data_.data()),
+                      lomc::PLANE_HEADER_SIZE + packed_control_data_size_);
+    packed_file.write(reinterpret_cast<const char*>(packed_block_data_.data()),
+                      packed_block_data_size_);
+  }
+
+  int32_t num_blocks() const {
+    return num_blocks_;
+  }
+
+  int32_t total_bits() const {
+    return total_bits_;
+  }
+
+  // The largest error bound that was used in the last frame.
+  int32_t max_error_bound() const {
+    return max_error_bound_;
+  }
+
+  // The number of blocks in the last frame that were not coded due to the byte budget.
+  int32_t num_dropped_blocks() const {
+    return num_dropped_blocks_;
+  }
+
+  // The number of forced key blocks that were coded in the last frame.
+  int32_t num_key_blocks() const {
+    return num_key_blocks_;
+  }
+
+#ifdef PRINT_TIMING
+  const stage_times& times() const {
+    return times_;
+  }
 #endif
 
-    // Pack all images.
-    int64_t total_packed_size = 0;
-    lomc::image images[2];
-    for (int32_t img_no = 0u; img_no < num_images; ++img_no) {
-      lomc::image& img = images[img_no % 2];
-      lomc::image& prev_img = images[(img_no + 1) % 2];
+private:
+  const int32_t plane_;
+  const int32_t num_layers_;
+  const int32_t key_block_period_;  // In base layer frames.
+  const int32_t width_;
+  const int32_t height_;
+  const int32_t blocks_per_row_;
+  const int32_t num_blocks_;
+  std::vector<uint8_t> clean_blocks_;
+  std::vector<uint8_t> skipped_blocks_;  // Clean blocks that were skipped in the last frame.
+  // For each block, the first frame that holds the current content of the block, i.e. the block
+  // is clean if the reference frame is that frame or a later one.
+  std::vector<int32_t> min_ref_frame_no_;
+  std::vector<dirty_rect> dirty_rects_;
+  bool has_dirty_rects_;
+  int32_t num_skipped_blocks_;
+  std::vector<uint8_t> control_data_;         // One control byte per block.
+  std::vector<uint8_t> packed_control_data_;  // Plane header + run-length coded control bytes.
+  std::vector<uint8_t> packed_block_data_;    // Worst case: A motion byte per block + raw pixels.
+  int32_t packed_control_data_size_;
+  int32_t packed_block_data_size_;
+  int32_t total_bits_;
+  int32_t error_level_;  // Index into ERROR_BOUNDS, carried over from the previous frame.
+  int32_t max_error_bound_;
+  int32_t num_dropped_blocks_;
+  int32_t num_key_blocks_;
+#ifdef PRINT_TIMING
+  stage_times times_;
+#endif
+};
+
+void plane_encoder::begin_frame(const int32_t img_no, const int32_t subsampling) {
+  const bool has_dirty_rects = has_dirty_rects_;
+  has_dirty_rects_ = false;
+  if (!has_dirty_rects || img_no == 0) {
+    std::fill(clean_blocks_.begin(), clean_blocks_.end(), 0u);
+    std::fill(min_ref_frame_no_.begin(), min_ref_frame_no_.end(), img_no);
+    return;
+  }
 
-      // Load the image.
-      std::string file_name = argv[img_no + 1];
-      img.load(file_name);
-      if (img.width() != width || img.height() != height) {
-        throw std::runtime_error("Incompatible image dimensions!");
+  // The rectangles are rounded outwards to whole pixels of the (possibly subsampled) plane.
+  const int32_t round = (1 << subsampling) - 1;
+  for (const dirty_rect& rect : dirty_rects_) {
+    const int32_t x0 = std::max(0, rect.x >> subsampling);
+    const int32_t y0 = std::max(0, rect.y >> subsampling);
+    const int32_t x1 = std::min(width_, (rect.x + rect.width + round) >> subsampling);
+    const int32_t y1 = std::min(height_, (rect.y + rect.height + round) >> subsampling);
+    if (x0 >= x1 || y0 >= y1) {
+      continue;
+    }
+    for (int32_t block_y = y0 / BLOCK_HEIGHT; block_y <= (y1 - 1) / BLOCK_HEIGHT; ++block_y) {
+      for (int32_t block_x = x0 / BLOCK_WIDTH; block_x <= (x1 - 1) / BLOCK_WIDTH; ++block_x) {
+        min_ref_frame_no_[static_cast<size_t>((block_y * blocks_per_row_) + block_x)] = img_no;
       }
+    }
+  }
 
-#ifdef DEBUG_PRINT_INFO
-      std::cout << "Image #" << img_no << ": " << file_name << " (" << img.width() << "x"
-                << img.height() << ")\n";
+  // With temporal layers, the reference frame is not necessarily the previous frame, so the
+  // changes of all the frames since the reference frame count.
+  const int32_t ref_frame_no = lomc::reference_frame_no(img_no, num_layers_);
+  for (size_t i = 0; i < clean_blocks_.size(); ++i) {
+    clean_blocks_[i] = (min_ref_frame_no_[i] <= ref_frame_no) ? 1u : 0u;
+  }
+}
+
+bool plane_encoder::same_as_reference(const lomc::image& img, const lomc::image& ref_img) const {
+  int32_t block_no = 0;
+  for (int32_t y = 0; y < img.height(); y += BLOCK_HEIGHT) {
+    const int32_t block_h = std::min(BLOCK_HEIGHT, img.height() - y);
+    for (int32_t x = 0; x < img.width(); x += BLOCK_WIDTH) {
+      const int32_t block_w = std::min(BLOCK_WIDTH, img.width() - x);
+      if (clean_blocks_[static_cast<size_t>(block_no++)] == 0u &&
+          !same_block(img, ref_img, x, y, block_w, block_h)) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+void plane_encoder::encode(const int32_t img_no,
+                           const int32_t layer,
+                           lomc::image& img,
+                           const lomc::image& ref_img,
+                           lomc::image* filter_image,
+                           const std::vector<motion_vector>& luma_vectors,
+                           const int32_t luma_blocks_per_row,
+                           const int32_t subsampling,
+                           const plane_budget& budget) {
+#ifdef ENABLE_FILTER
+  assert(filter_image != nullptr);
+#else
+  (void)filter_image;
+#endif
+#ifndef ENABLE_MOTION_COMPENSATION
+  (void)luma_vectors;
+  (void)luma_blocks_per_row;
+  (void)subsampling;
 #endif
 
 #ifdef DEBUG_EXPORT_DELTA_IMAGE
-      lomc::image delta(img.width(), img.height());
+  lomc::image delta(img.width(), img.height());
 #endif
 
-      int32_t total_bits = 0;
+  total_bits_ = 0;
+  max_error_bound_ = 0;
+  num_dropped_blocks_ = 0;
+  num_key_blocks_ = 0;
+  num_skipped_blocks_ = 0;
+  control_size_counter control_size;
+  bool out_of_budget = false;
+  const int32_t num_block_rows = (img.height() + BLOCK_HEIGHT - 1) / BLOCK_HEIGHT;
+
+#ifdef PRINT_TIMING
+  times_ = stage_times();
+  stage_clock clock;
+#endif
 
-      // Iterate over all the blocks and pack them individually.
-      uint8_t* control_data_ptr = packed_frame_data.data() + 4;
-      uint8_t* packed_frame_data_ptr = control_data_ptr + control_data_size;
-      int32_t block_no = 0;
-      for (int32_t y = 0; y < img.height(); y += BLOCK_HEIGHT) {
-        const int32_t block_h = std::min(BLOCK_HEIGHT, img.height() - y);
-        for (int32_t x = 0; x < img.width(); x += BLOCK_WIDTH) {
-          const int32_t block_w = std::min(BLOCK_WIDTH, img.width() - x);
-
-          uint8_t unpacked_block_data_mem[BLOCK_WIDTH * BLOCK_HEIGHT * 2];
-          uint8_t* unpacked_block_data[2] = {&unpacked_block_data_mem[0],
-                                             &unpacked_block_data_mem[BLOCK_WIDTH * BLOCK_HEIGHT]};
-
-          // Every now and then we force each block to be encoded independently of the previous
-          // frame in order to be able to recover from frame losses and similar. From any given
-          // frame, it takes FRAMES_BETWEEN_FORCED_KEY_BLOCK until a frame can be fully
-          // reconstructed.
-          const bool force_key_block =
-              (((img_no + block_no) % FRAMES_BETWEEN_FORCED_KEY_BLOCK) == 0);
-          const bool can_do_frame_delta = (img_no > 0) && !force_key_block;
-
-          uint8_t best_num_bits = 9;
-          int32_t selected_unpacked_block_no = 0;
-          block_type bt = BLOCK_COPY;
-
-          int32_t motion_dx = 0;
-          int32_t motion_dy = 0;
-          bool can_use_filter = false;
+  // Iterate over all the blocks and pack them individually. Each block passes through the
+  // following pipeline stages:
+  //  1. Motion vector lookup (the motion search is done for the luma plane before encoding the
+  //     planes).
+  //  2. Residual generation (frame delta, row delta or copy). When the temporal pre-filter is
+  //     enabled, the filtered block is calculated in the same pass as the frame delta, so that
+  //     the reference and input pixels are only loaded once.
+  //  3. Temporal pre-filter (update filter_image, which is used as the motion compensated
+  //     reference for the next frame).
+  //  4. Bit packing.
+  uint8_t* packed_block_data_ptr = packed_block_data_.data();
+  int32_t block_no = 0;
+  for (int32_t y = 0; y < img.height(); y += BLOCK_HEIGHT) {
+    const int32_t block_h = std::min(BLOCK_HEIGHT, img.height() - y);
+
+    // Rate control: Raise or lower the error bound for the next block row, depending on whether
+    // the plane is ahead of or behind its target size so far.
+    if (budget.target_bytes != NO_BUDGET && y > 0) {
+      const int64_t used_bytes =
+          static_cast<int64_t>(packed_block_data_ptr - packed_block_data_.data()) +
+          control_size.size();
+      const int64_t expected_bytes =
+          (static_cast<int64_t>(budget.target_bytes) * (y / BLOCK_HEIGHT)) / num_block_rows;
+      if ((used_bytes * 10) > (expected_bytes * 11) && error_level_ < MAX_ERROR_LEVEL) {
+        ++error_level_;
+      } else if ((used_bytes * 10) < (expected_bytes * 8) && error_level_ > 0) {
+        --error_level_;
+      }
+    }
+    const int32_t error_bound = ERROR_BOUNDS[error_level_];
+    max_error_bound_ = std::max(max_error_bound_, error_bound);
+
+    for (int32_t x = 0; x < img.width(); x += BLOCK_WIDTH) {
+      const int32_t block_w = std::min(BLOCK_WIDTH, img.width() - x);
+
+#ifdef PRINT_TIMING
+      clock.restart();
+#endif
+
+      // Note: The memory is cleared so that the unused columns of partial blocks pack cleanly.
+      uint8_t unpacked_block_data_mem[BLOCK_WIDTH * BLOCK_HEIGHT * 2] = {};
+      uint8_t* unpacked_block_data[2] = {&unpacked_block_data_mem[0],
+                                         &unpacked_block_data_mem[BLOCK_WIDTH * BLOCK_HEIGHT]};
+
+      // Reconstructed pixels of the near-lossless residuals (same layout as the residuals).
+      uint8_t reconstructed_mem[BLOCK_WIDTH * BLOCK_HEIGHT * 2];
+      uint8_t* reconstructed[2] = {&reconstructed_mem[0],
+                                   &reconstructed_mem[BLOCK_WIDTH * BLOCK_HEIGHT]};
+
+      // Forced key blocks are coded independently of the previous frame, even when clean.
+      const bool force_key_block = is_forced_key_block(img_no, layer, block_no);
+      const bool can_do_frame_delta = (img_no > 0) && !force_key_block;
+
+      // Dirty rectangle hints: A clean block (unless it is due for a forced key block) is coded
+      // as a skip block right away, without touching its pixels.
+      const bool is_skipped =
+          (clean_blocks_[static_cast<size_t>(block_no)] != 0u) && !force_key_block;
+      skipped_blocks_[static_cast<size_t>(block_no)] = is_skipped ? 1u : 0u;
+      if (is_skipped) {
+        ++num_skipped_blocks_;
+        control_data_[static_cast<size_t>(block_no)] = lomc::CONTROL_SKIP;
+        control_size.add(lomc::CONTROL_SKIP);
+        ++block_no;
+        continue;
+      }
+
+      uint8_t best_num_bits = 9;
+      int32_t selected_unpacked_block_no = 0;
+      block_type bt = BLOCK_COPY;
+
+      int32_t motion_dx = 0;
+      int32_t motion_dy = 0;
+      bool can_use_filter = false;
+      bool is_static_block = false;
 #ifdef ENABLE_MOTION_COMPENSATION
-          if (can_do_frame_delta) {
-            const int32_t min_x_offset = std::max(MOTION_DELTA_MIN, -x);
-            const int32_t max_x_offset = std::min(MOTION_DELTA_MAX, width - block_w - x);
-            const int32_t min_y_offset = std::max(MOTION_DELTA_MIN, -y);
-            const int32_t max_y_offset = std::min(MOTION_DELTA_MAX, height - block_h - y);
-            int32_t min_error = 0x7fffffffu;
-            int32_t min_offset = 0x7fffffffu;
-            for (int32_t dy = min_y_offset; dy <= max_y_offset; ++dy) {
-              for (int32_t dx = min_x_offset; dx <= max_x_offset; ++dx) {
-                int32_t error = match_score(&prev_img[((y + dy) * img.stride()) + (x + dx)],
-                                            &img[(y * img.stride()) + x],
-                                            block_w,
-                                            block_h,
-                                            img.stride());
-                if (error <= min_error) {
-                  int32_t offset = (dx * dx) + (dy * dy);
-                  if ((error < min_error) || (offset < min_offset)) {
-                    motion_dx = dx;
-                    motion_dy = dy;
-                    min_error = error;
-                    min_offset = offset;
-                  }
-                }
-              }
-            }
+      if (can_do_frame_delta) {
+        const motion_vector mv =
+            (plane_ == 0) ? luma_vectors[static_cast<size_t>(block_no)]
+                          : scaled_motion_vector(luma_vectors,
+                                                 luma_blocks_per_row,
+                                                 subsampling,
+                                                 img,
+                                                 ref_img,
+                                                 x,
+                                                 y,
+                                                 block_w,
+                                                 block_h);
+        if (mv.is_match) {
+          motion_dx = mv.dx;
+          motion_dy = mv.dy;
+          can_use_filter = true;
+          is_static_block = (mv.error == 0) && (motion_dx == 0) && (motion_dy == 0);
+        }
+      }
+#endif
 
-            // Could we find a good enough match?
-            const int32_t ERROR_THRESHOLD = (BLOCK_HEIGHT * BLOCK_WIDTH) * (20 * 20);
-            if (min_error <= ERROR_THRESHOLD) {
-              can_use_filter = true;
-            } else {
-              motion_dx = 0;
-              motion_dy = 0;
-            }
-          }
+#ifdef PRINT_TIMING
+      clock.lap(times_.motion_search);
 #endif
 
-          // First choice: frame delta.
-          if (can_do_frame_delta) {
 #ifdef ENABLE_FILTER
-            lomc::image& delta_img = can_use_filter ? filter_image : prev_img;
-#else
-            lomc::image& delta_img = prev_img;
-#endif
-            assert(img.width() == delta_img.width() && img.height() == delta_img.height() &&
-                   img.stride() == delta_img.stride());
-
-            // Make a delta to the previous frame. This ususally has the best compression.
-            int32_t unpacked_block_no = (selected_unpacked_block_no + 1) % 2;
-            uint8_t num_bits;
-            block_frame_delta(&delta_img[((y + motion_dy) * img.stride()) + (x + motion_dx)],
-                              &img[(y * img.stride()) + x],
-                              block_w,
-                              block_h,
-                              img.stride(),
-                              unpacked_block_data[unpacked_block_no],
-                              num_bits);
-            if (num_bits < best_num_bits) {
-              bt = BLOCK_DELTA_FRAME;
-              best_num_bits = num_bits;
-              selected_unpacked_block_no = unpacked_block_no;
-            }
-          }
+      // Output of the temporal pre-filter (only valid if can_use_filter is true).
+      uint8_t filtered_block[BLOCK_WIDTH * BLOCK_HEIGHT];
+#endif
 
-          // Second choice: row delta.
-          if (best_num_bits > 2) {
-            // Do not depend on the previous frame. This does not compress as good.
-            int32_t unpacked_block_no = (selected_unpacked_block_no + 1) % 2;
-            uint8_t num_bits;
-            block_row_delta(&img[(y * img.stride()) + x],
+      // First choice: frame delta.
+      if (can_do_frame_delta) {
+#ifdef ENABLE_FILTER
+        const lomc::image& delta_img = can_use_filter ? *filter_image : ref_img;
+        uint8_t* filtered = can_use_filter ? filtered_block : nullptr;
+#else
+        const lomc::image& delta_img = ref_img;
+        uint8_t* filtered = nullptr;
+#endif
+        assert(img.width() == delta_img.width() && img.height() == delta_img.height());
+
+        // Make a delta to the previous frame. This ususally has the best compression.
+        int32_t unpacked_block_no = (selected_unpacked_block_no + 1) % 2;
+        uint8_t num_bits;
+        if (error_bound > 0) {
+          block_frame_delta_near_lossless(
+              &delta_img[((y + motion_dy) * delta_img.stride()) + (x + motion_dx)],
+              &img[(y * img.stride()) + x],
+              block_w,
+              block_h,
+              delta_img.stride(),
+              img.stride(),
+              error_bound,
+              unpacked_block_data[unpacked_block_no],
+              reconstructed[unpacked_block_no],
+              num_bits);
+        } else {
+          block_frame_delta(&delta_img[((y + motion_dy) * delta_img.stride()) + (x + motion_dx)],
+                            &img[(y * img.stride()) + x],
                             block_w,
                             block_h,
+                            delta_img.stride(),
                             img.stride(),
                             unpacked_block_data[unpacked_block_no],
+                            filtered,
                             num_bits);
-            if (num_bits < best_num_bits) {
-              bt = BLOCK_DELTA_ROW;
-              best_num_bits = num_bits;
-              selected_unpacked_block_no = unpacked_block_no;
-            }
-          }
+        }
+        if (num_bits < best_num_bits) {
+          bt = BLOCK_DELTA_FRAME;
+          best_num_bits = num_bits;
+          selected_unpacked_block_no = unpacked_block_no;
+        }
+      }
 
-          // Fall back to block copy if we could not pack.
-          if (best_num_bits >= 8) {
-            int32_t unpacked_block_no = (selected_unpacked_block_no + 1) % 2;
-            uint8_t num_bits;
-            block_copy(&img[(y * img.stride()) + x],
-                       block_w,
-                       block_h,
-                       img.stride(),
-                       unpacked_block_data[unpacked_block_no],
-                       num_bits);
-            bt = BLOCK_COPY;
-            best_num_bits = num_bits;
-            selected_unpacked_block_no = unpacked_block_no;
-          }
+      // Second choice: row delta.
+      if (best_num_bits > 2) {
+        // Do not depend on the previous frame. This does not compress as good.
+        int32_t unpacked_block_no = (selected_unpacked_block_no + 1) % 2;
+        uint8_t num_bits;
+        if (error_bound > 0) {
+          block_row_delta_near_lossless(&img[(y * img.stride()) + x],
+                                        block_w,
+                                        block_h,
+                                        img.stride(),
+                                        error_bound,
+                                        unpacked_block_data[unpacked_block_no],
+                                        reconstructed[unpacked_block_no],
+                                        num_bits);
+        } else {
+          block_row_delta(&img[(y * img.stride()) + x],
+                          block_w,
+                          block_h,
+                          img.stride(),
+                          unpacked_block_data[unpacked_block_no],
+                          num_bits);
+        }
+        if (num_bits < best_num_bits) {
+          bt = BLOCK_DELTA_ROW;
+          best_num_bits = num_bits;
+          selected_unpacked_block_no = unpacked_block_no;
+        }
+      }
 
+      // Fall back to block copy if we could not pack.
+      if (best_num_bits >= 8) {
+        int32_t unpacked_block_no = (selected_unpacked_block_no + 1) % 2;
+        uint8_t num_bits;
+        block_copy(&img[(y * img.stride()) + x],
+                   block_w,
+                   block_h,
+                   img.stride(),
+                   unpacked_block_data[unpacked_block_no],
+                   num_bits);
+        bt = BLOCK_COPY;
+        best_num_bits = num_bits;
+        selected_unpacked_block_no = unpacked_block_no;
+      }
+
+      // A 0-bit frame delta block that is identical to the co-located block in both the
+      // reference frame and the filter image is coded as a skip block (without a motion
+      // vector). Without motion compensation, the filter image is always a copy of the
+      // reference frame.
+      bool is_skip_block = (bt == BLOCK_DELTA_FRAME) && (best_num_bits == 0) &&
+                           (!can_use_filter || is_static_block);
+
+      // A near-lossless 0-bit frame delta without motion reconstructs the filter image block,
+      // which can also be a skip block if it is identical to the reference frame block.
+      if (!is_skip_block && error_bound > 0 && bt == BLOCK_DELTA_FRAME && best_num_bits == 0 &&
+          motion_dx == 0 && motion_dy == 0) {
 #ifdef ENABLE_FILTER
-          if (can_use_filter) {
-            for (int32_t i = 0; i < block_h; ++i) {
-              int32_t yy = y + i;
-              const uint8_t* src1_data =
-                  &filter_image[((yy + motion_dy) * filter_image.stride()) + (x + motion_dx)];
-              const uint8_t* src2_data = &img[(yy * img.stride()) + x];
-              uint8_t* dst_data = &filter_image[(yy * filter_image.stride()) + x];
-              for (int32_t j = 0; j < block_w; ++j) {
-                const uint32_t c1 = static_cast<uint32_t>(src1_data[j]);
-                const uint32_t c2 = static_cast<uint32_t>(src2_data[j]);
-                dst_data[j] = static_cast<uint8_t>(((c1 * 3) + c2) >> 2);
-              }
-            }
-          } else {
-            // Clear the filtered block: Copy the input image to the filtered image.
-            for (int32_t i = 0; i < block_h; ++i) {
-              int32_t yy = y + i;
-              const uint8_t* src_data = &img[(yy * img.stride()) + x];
-              uint8_t* dst_data = &filter_image[(yy * filter_image.stride()) + x];
-              for (int32_t j = 0; j < block_w; ++j) {
-                dst_data[j] = src_data[j];
-              }
-            }
-          }
+        is_skip_block = same_block(*filter_image, ref_img, x, y, block_w, block_h);
+#else
+        is_skip_block = true;
+#endif
+      }
+
+      // Rate control: Once a block would make the plane exceed its maximum size (while reserving
+      // enough bytes for the control data of the remaining blocks), this block and all the
+      // remaining blocks are dropped, i.e. coded as skip blocks that keep the reference pixels.
+      if (budget.max_bytes != NO_BUDGET && img_no > 0 && !out_of_budget && !is_skip_block) {
+        int32_t block_bytes = can_use_filter ? 1 : 0;
+        for (int32_t row = 0; row < block_h; ++row) {
+          const uint8_t num_bits = (bt == BLOCK_DELTA_ROW && row == 0) ? 8u : best_num_bits;
+          block_bytes += 2 * static_cast<int32_t>(num_bits);
+        }
+        const int32_t remaining_blocks = num_blocks_ - block_no - 1;
+        const int32_t reserved_bytes =
+            2 * ((remaining_blocks + MAX_CONTROL_RUN - 1) / MAX_CONTROL_RUN);
+        const int32_t used_bytes =
+            static_cast<int32_t>(packed_block_data_ptr - packed_block_data_.data()) +
+            control_size.size();
+        const uint8_t control_byte =
+            static_cast<uint8_t>(bt << lomc::CONTROL_BLOCK_TYPE_SHIFT) | best_num_bits |
+            (can_use_filter ? lomc::CONTROL_MOTION : 0u);
+        if (used_bytes + block_bytes + control_size.cost(control_byte) + reserved_bytes >
+            budget.max_bytes) {
+          out_of_budget = true;
+        }
+      }
+      if (out_of_budget && !is_skip_block) {
+        bt = BLOCK_DELTA_FRAME;
+        best_num_bits = 0;
+        can_use_filter = false;
+        is_skip_block = true;
+        std::memset(unpacked_block_data[selected_unpacked_block_no], 0, BLOCK_WIDTH * BLOCK_HEIGHT);
+        ++num_dropped_blocks_;
+      }
+
+      // Near-lossless blocks: The decoder will see the reconstructed pixels rather than the input
+      // pixels, so they replace the input pixels (which are not needed anymore). The filtered
+      // block is recalculated from the reconstructed pixels.
+      if (is_skip_block && (error_bound > 0 || out_of_budget)) {
+        copy_block(&ref_img[(y * ref_img.stride()) + x],
+                   ref_img.stride(),
+                   block_w,
+                   block_h,
+                   &img[(y * img.stride()) + x],
+                   img.stride());
+      } else if (!is_skip_block && error_bound > 0) {
+        if (bt != BLOCK_COPY) {
+          copy_block(reconstructed[selected_unpacked_block_no],
+                     BLOCK_WIDTH,
+                     block_w,
+                     block_h,
+                     &img[(y * img.stride()) + x],
+                     img.stride());
+        }
+#ifdef ENABLE_FILTER
+        if (can_use_filter) {
+          uint8_t unused_deltas[BLOCK_WIDTH * BLOCK_HEIGHT];
+          uint8_t unused_num_bits;
+          block_frame_delta(
+              &(*filter_image)[((y + motion_dy) * filter_image->stride()) + (x + motion_dx)],
+              &img[(y * img.stride()) + x],
+              block_w,
+              block_h,
+              filter_image->stride(),
+              img.stride(),
+              unused_deltas,
+              filtered_block,
+              unused_num_bits);
+        }
 #endif
+      }
 
-#if 0 && defined(DEBUG_PRINT_INFO)
-          static int32_t num_bits_histogram[10];
-          num_bits_histogram[best_num_bits]++;
-          if ((block_no % 100) == 0) {
-            for (int i = 0; i < 9; ++i) {
-              std::cout << num_bits_histogram[i] << " ";
-            }
-            std::cout << num_bits_histogram[9] << "\n";
-          }
+#ifdef PRINT_TIMING
+      // Including the filter blend, which is done by block_frame_delta().
+      clock.lap(times_.residual);
 #endif
 
-          total_bits += static_cast<int32_t>(best_num_bits);
-
-          // Output the control byte for this block.
-          uint8_t control_byte = static_cast<uint8_t>(bt << 4) | best_num_bits;
-          control_data_ptr[block_no] = control_byte;
-
-          // Output the packed pixel deltas.
-          // Special case: BLOCK_DELTA_ROW always uses 8 bits for the first row.
-          uint8_t num_bits_for_next_row = (bt == BLOCK_DELTA_ROW) ? 8 : best_num_bits;
-          uint8_t* src_data = unpacked_block_data[selected_unpacked_block_no];
-          for (int32_t row = 0; row < block_h; ++row) {
-            apply_offset(num_bits_for_next_row, src_data);
-            switch (num_bits_for_next_row) {
-              case 1u:
-                packbits_1(src_data, packed_frame_data_ptr);
-                break;
-              case 2u:
-                packbits_2(src_data, packed_frame_data_ptr);
-                break;
-              case 4u:
-                packbits_4(src_data, packed_frame_data_ptr);
-                break;
-              case 8u:
-                packbits_8(src_data, packed_frame_data_ptr);
-                break;
-              case 0u:
-                break;
-              default:
-                throw std::runtime_error("Invalid num_bits");
-            }
-            src_data += BLOCK_WIDTH;
-            num_bits_for_next_row = best_num_bits;
-          }
+#ifdef ENABLE_FILTER
+      // Temporal pre-filter: If we found a good motion match, the filtered block (a blend of
+      // the motion compensated filter image and the input image) has already been calculated
+      // by block_frame_delta(). Otherwise the filter is reset to the input block. Skip blocks
+      // are already identical to the filter image.
+      if (is_skip_block) {
+        // Nothing to do.
+      } else if (can_use_filter) {
+        copy_block(filtered_block,
+                   BLOCK_WIDTH,
+                   block_w,
+                   block_h,
+                   &(*filter_image)[(y * filter_image->stride()) + x],
+                   filter_image->stride());
+      } else {
+        copy_block(&img[(y * img.stride()) + x],
+                   img.stride(),
+                   block_w,
+                   block_h,
+                   &(*filter_image)[(y * filter_image->stride()) + x],
+                   filter_image->stride());
+      }
+#endif
+
+#ifdef PRINT_TIMING
+      clock.lap(times_.filter);
+#endif
+
+      total_bits_ += static_cast<int32_t>(best_num_bits);
+
+      // Output the control byte for this block.
+      uint8_t control_byte =
+          static_cast<uint8_t>(bt << lomc::CONTROL_BLOCK_TYPE_SHIFT) | best_num_bits;
+      if (can_use_filter && !is_skip_block) {
+        // The decoder needs the motion vector for the filter and the frame delta reference.
+        control_byte |= lomc::CONTROL_MOTION;
+        *packed_block_data_ptr++ = lomc::pack_motion(motion_dx, motion_dy);
+      }
+      control_data_[static_cast<size_t>(block_no)] = control_byte;
+      control_size.add(control_byte);
+
+      // Output the packed pixel deltas.
+      // Special case: BLOCK_DELTA_ROW always uses 8 bits for the first row.
+      uint8_t num_bits_for_next_row = (bt == BLOCK_DELTA_ROW) ? 8 : best_num_bits;
+      uint8_t* src_data = unpacked_block_data[selected_unpacked_block_no];
+      for (int32_t row = 0; row < block_h; ++row) {
+        lomc::pack_row(num_bits_for_next_row, src_data, packed_block_data_ptr);
+        src_data += BLOCK_WIDTH;
+        num_bits_for_next_row = best_num_bits;
+      }
+
+#ifdef PRINT_TIMING
+      clock.lap(times_.packing);
+#endif
 
 #ifdef DEBUG_EXPORT_DELTA_IMAGE
-          // Copy the unpacked block data to the delta image (for debugging).
-          for (int32_t i = 0; i < block_h; ++i) {
-            int32_t yy = y + i;
-            const uint8_t* src_data = unpacked_block_data[selected_unpacked_block_no];
-            for (int32_t j = 0; j < block_w; ++j) {
-              int32_t xx = x + j;
-              delta[(yy * delta.stride()) + xx] = src_data[(i * BLOCK_WIDTH) + j];
-            }
-          }
+      // Copy the unpacked block data to the delta image (for debugging).
+      for (int32_t i = 0; i < block_h; ++i) {
+        int32_t yy = y + i;
+        const uint8_t* src_data = unpacked_block_data[selected_unpacked_block_no];
+        for (int32_t j = 0; j < block_w; ++j) {
+          int32_t xx = x + j;
+          delta[(yy * delta.stride()) + xx] = src_data[(i * BLOCK_WIDTH) + j];
+        }
+      }
 #endif
-          ++block_no;
 
-#if defined(DEBUG_PRINT_INFO)
-          {
-            static const char ascii_art[] = {'.', '-', '+', '*'};
-            int32_t d = (motion_dx * motion_dx) + (motion_dy * motion_dy);
-            d = ((d * 3) + 64) / 128;
-            assert(d < 4);
-            std::cout << ascii_art[d];
-          }
+      // A dropped block keeps stale pixels, so it must be coded in later frames even if it is
+      // not dirty. Near-lossless blocks are left as they are until the next forced key block.
+      if (out_of_budget) {
+        min_ref_frame_no_[static_cast<size_t>(block_no)] = img_no + 1;
+      } else if (force_key_block) {
+        ++num_key_blocks_;
+      }
+      ++block_no;
+    }
+  }
+
+  // Run-length code the control bytes, after the plane header.
+  packed_control_data_size_ = pack_control_data(
+      control_data_.data(), num_blocks_, &packed_control_data_[lomc::PLANE_HEADER_SIZE]);
+  packed_block_data_size_ =
+      static_cast<int32_t>(packed_block_data_ptr - packed_block_data_.data());
+  lomc::pack_int32(packed_control_data_size_, &packed_control_data_[0]);
+  lomc::pack_int32(packed_block_data_size_, &packed_control_data_[4]);
+
+#ifdef DEBUG_EXPORT_DELTA_IMAGE
+  delta.save(debug_file_name("out_delta_", img_no, plane_));
+#endif
+#ifdef DEBUG_EXPORT_FILTERED_IMAGE
+  filter_image->save(debug_file_name("out_filt_", img_no, plane_));
 #endif
+}
+
+void plane_encoder::end_frame(lomc::reference_frames& refs) {
+  // The reconstructed frame is split between img (the coded blocks) and the reference frame (the
+  // skipped clean blocks). It is completed by copying the smaller part into the other one, so that
+  // with dirty rectangle hints the cost is proportional to the changed area (unless the reference
+  // frame is still needed by later frames).
+  if (num_skipped_blocks_ == 0 || !refs.is_stored()) {
+    refs.end_frame(false);
+    return;
+  }
+  const bool in_place = refs.can_update_in_place() && (num_skipped_blocks_ * 2 > num_blocks_);
+  lomc::image& img = refs.current();
+  const lomc::image& ref_img = refs.reference();
+  lomc::image* in_place_img = in_place ? &refs.reference_in_place() : nullptr;
+  int32_t block_no = 0;
+  for (int32_t y = 0; y < img.height(); y += BLOCK_HEIGHT) {
+    const int32_t block_h = std::min(BLOCK_HEIGHT, img.height() - y);
+    for (int32_t x = 0; x < img.width(); x += BLOCK_WIDTH) {
+      const int32_t block_w = std::min(BLOCK_WIDTH, img.width() - x);
+      const bool is_skipped = skipped_blocks_[static_cast<size_t>(block_no++)] != 0u;
+      if (in_place && !is_skipped) {
+        copy_block(&img[(y * img.stride()) + x],
+                   img.stride(),
+                   block_w,
+                   block_h,
+                   &(*in_place_img)[(y * in_place_img->stride()) + x],
+                   in_place_img->stride());
+      } else if (!in_place && is_skipped) {
+        copy_block(&ref_img[(y * ref_img.stride()) + x],
+                   ref_img.stride(),
+                   block_w,
+                   block_h,
+                   &img[(y * img.stride()) + x],
+                   img.stride());
+      }
+    }
+  }
+  if (in_place) {
+    refs.end_frame_in_place();
+  } else {
+    refs.end_frame(false);
+  }
+}
+
+// Rate control for constant bandwidth links. The packed frames are modelled as being sent through
+// a buffer (VBV) that is drained by target_frame_bytes per frame, and that must never overflow.
+// Each frame gets a target size that steers the buffer towards being half full, and a maximum
+// size that is the free space in the buffer. With a buffer size equal to the target frame size,
+// every frame is limited to the target frame size.
+class rate_controller {
+public:
+  rate_controller(const int32_t target_frame_bytes, const int32_t buffer_bytes)
+      : target_frame_bytes_(target_frame_bytes),
+        buffer_bytes_(std::max(buffer_bytes, target_frame_bytes)),
+        buffer_level_(0),
+        num_frames_(0),
+        total_bytes_(0),
+        max_frame_bytes_(0),
+        num_frames_over_target_(0),
+        num_overflows_(0) {
+    if (target_frame_bytes < 1) {
+      throw std::runtime_error("Invalid target frame size");
+    }
+  }
+
+  int32_t target_bytes() const {
+    const int32_t target =
+        target_frame_bytes_ + ((((buffer_bytes_ - target_frame_bytes_) / 2) - buffer_level_) / 4);
+    return std::max(1, std::min(target, max_bytes()));
+  }
+
+  int32_t max_bytes() const {
+    return std::max(0, buffer_bytes_ - buffer_level_);
+  }
+
+  void end_frame(const int32_t frame_bytes) {
+    if (frame_bytes > target_frame_bytes_) {
+      ++num_frames_over_target_;
+    }
+
+    // The first frame can not be limited (it has no reference frame), so it is sent ahead of the
+    // stream rather than being counted in the buffer.
+    if (num_frames_ > 0) {
+      if (frame_bytes > max_bytes()) {
+        ++num_overflows_;
+      }
+      buffer_level_ = std::max(0, buffer_level_ + frame_bytes - target_frame_bytes_);
+    }
+    ++num_frames_;
+    total_bytes_ += frame_bytes;
+    max_frame_bytes_ = std::max(max_frame_bytes_, frame_bytes);
+  }
+
+  int32_t buffer_level() const {
+    return buffer_level_;
+  }
+
+  void print_summary() const {
+    if (num_frames_ > 0) {
+      std::cout << "Rate control: target " << target_frame_bytes_ << " bytes/frame, average "
+                << (total_bytes_ / num_frames_) << ", max " << max_frame_bytes_ << ", "
+                << num_frames_over_target_ << " of " << num_frames_ << " frames over target, "
+                << num_overflows_ << " buffer overflows\n";
+    }
+  }
+
+private:
+  const int32_t target_frame_bytes_;
+  const int32_t buffer_bytes_;
+  int32_t buffer_level_;
+  int32_t num_frames_;
+  int64_t total_bytes_;
+  int32_t max_frame_bytes_;
+  int32_t num_frames_over_target_;
+  int32_t num_overflows_;
+};
+// Load the dirty rectangles of all the frames from a text file with one "frame x y width height"
+// line per rectangle.
+std::vector<std::vector<dirty_rect>> load_dirty_rects(const std::string& file_name) {
+  std::ifstream file(file_name.c_str());
+  if (!file) {
+    throw std::runtime_error("Failed to open " + file_name);
+  }
+  std::vector<std::vector<dirty_rect>> frames;
+  std::string line;
+  while (std::getline(file, line)) {
+    if (line.empty() || line[0] == '#') {
+      continue;
+    }
+    std::istringstream fields(line);
+    int32_t frame_no;
+    dirty_rect rect;
+    if (!(fields >> frame_no >> rect.x >> rect.y >> rect.width >> rect.height) || frame_no < 0) {
+      throw std::runtime_error("Invalid dirty rectangle: " + line);
+    }
+    if (frame_no >= static_cast<int32_t>(frames.size())) {
+      frames.resize(static_cast<size_t>(frame_no) + 1);
+    }
+    frames[static_cast<size_t>(frame_no)].push_back(rect);
+  }
+  return frames;
+}
+}  // namespace
+
+// Usage: demo [options] INPUT
+//
+// INPUT:
+//   frame_0000.pgm frame_0001.pgm ...  (gray)
+//   video.y4m                          (YUV 4:2:0 or mono)
+//   --raw WIDTHxHEIGHT video.yuv       (raw I420)
+//
+// Options:
+//   --frame-bytes N       Target packed frame size (enables rate control).
+//   --bitrate N --fps F   Target bit rate in bits/s (enables rate control), default 30 fps.
+//   --vbv-bytes N         Transmission buffer size, default one target frame.
+//   --temporal-layers N   Number of temporal layers (1 to 4), default 1. With more than one layer,
+//                         a decoder can drop the upper layers to decode at 1/2, 1/4 or 1/8 of
+//                         the frame rate.
+//   --key-block-period N  Number of frames between forced key blocks, default 32. Key blocks are
+//                         only placed in base layer frames, so with temporal layers the period
+//                         must be at least 2^(layers - 1) frames, and is rounded down to a
+//                         multiple of that.
+//   --dirty-rects FILE    Changed rectangles of each frame, one "frame x y width height" line
+//                         per rectangle. Frames without any rectangles are unchanged.
+int main(int argc, const char** argv) {
+  try {
+    // Parse the command line.
+    std::vector<std::string> inputs;
+    int32_t raw_width = 0;
+    int32_t raw_height = 0;
+    int32_t target_frame_bytes = 0;
+    int64_t bitrate = 0;
+    double fps = 30.0;
+    int32_t vbv_bytes = 0;
+    int32_t num_layers = 1;
+    int32_t key_block_period = FRAMES_BETWEEN_FORCED_KEY_BLOCK;
+    std::string dirty_rects_file;
+    for (int i = 1; i < argc; ++i) {
+      const std::string arg = argv[i];
+      const bool has_value = (i + 1) < argc;
+      if (arg == "--raw" && has_value) {
+        char separator = 0;
+        std::istringstream size(argv[++i]);
+        size >> raw_width >> separator >> raw_height;
+      } else if (arg == "--frame-bytes" && has_value) {
+        target_frame_bytes = std::stoi(argv[++i]);
+      } else if (arg == "--bitrate" && has_value) {
+        bitrate = std::stoll(argv[++i]);
+      } else if (arg == "--fps" && has_value) {
+        fps = std::stod(argv[++i]);
+      } else if (arg == "--vbv-bytes" && has_value) {
+        vbv_bytes = std::stoi(argv[++i]);
+      } else if (arg == "--temporal-layers" && has_value) {
+        num_layers = std::stoi(argv[++i]);
+      } else if (arg == "--key-block-period" && has_value) {
+        key_block_period = std::stoi(argv[++i]);
+      } else if (arg == "--dirty-rects" && has_value) {
+        dirty_rects_file = argv[++i];
+      } else {
+        inputs.push_back(arg);
+      }
+    }
+    if (bitrate > 0) {
+      target_frame_bytes = static_cast<int32_t>(static_cast<double>(bitrate) / (8.0 * fps));
+    }
+    if (num_layers < 1 || num_layers > lomc::MAX_TEMPORAL_LAYERS) {
+      throw std::runtime_error("Invalid number of temporal layers.");
+    }
+    // Key blocks are only placed in base layer frames, so the period can not be shorter than the
+    // distance between two base layer frames.
+    if (key_block_period < (1 << (num_layers - 1))) {
+      throw std::runtime_error("The key block period must be at least 2^(temporal layers - 1).");
+    }
+    std::vector<std::vector<dirty_rect>> dirty_rects;
+    if (!dirty_rects_file.empty()) {
+      dirty_rects = load_dirty_rects(dirty_rects_file);
+    }
+    std::unique_ptr<rate_controller> rate_control;
+    if (target_frame_bytes != 0) {
+      rate_control.reset(new rate_controller(target_frame_bytes, vbv_bytes));
+    }
+
+    // Open the input.
+    std::unique_ptr<lomc::yuv_reader> reader;
+    std::vector<std::string> pgm_files;
+    if (raw_width > 0 && inputs.size() == 1) {
+      reader.reset(new lomc::yuv_reader(inputs[0], raw_width, raw_height));
+    } else if (inputs.size() == 1 && inputs[0].size() > 4 &&
+               inputs[0].compare(inputs[0].size() - 4, 4, ".y4m") == 0) {
+      reader.reset(new lomc::yuv_reader(inputs[0]));
+    } else {
+      pgm_files = inputs;
+      if (pgm_files.empty()) {
+        throw std::runtime_error("No input files provided.");
+      }
+    }
+
+    // Determine the movie properties (from the first image if the input is a list of images).
+    int32_t width;
+    int32_t height;
+    lomc::pixel_format format;
+    if (reader) {
+      width = reader->width();
+      height = reader->height();
+      format = reader->format();
+    } else {
+      lomc::image first_img;
+      first_img.load(pgm_files[0]);
+      width = first_img.width();
+      height = first_img.height();
+      format = lomc::PIXEL_FORMAT_GRAY;
+    }
+    const int32_t num_planes = lomc::num_planes(format);
+
+#ifdef DEBUG_PRINT_INFO
+    std::cout << "Dimensions: " << width << "x" << height << "\n";
+    std::cout << "# planes: " << num_planes << "\n";
+    if (!reader) {
+      std::cout << "# frames: " << pgm_files.size() << "\n";
+    }
+    std::cout << "# blocks / frame: " << lomc::blocks_per_frame(width, height) << "\n";
+#endif
+
+    // Create the output file. The number of frames in the header is filled in at the end.
+    std::ofstream packed_file("packed.lmc", std::ios::out | std::ios::binary);
+#ifdef ENABLE_FILTER
+    const bool use_filter = true;
+#else
+    const bool use_filter = false;
+#endif
+    const uint32_t file_flags =
+        (use_filter ? lomc::FILE_FLAG_FILTER : 0u) |
+        (static_cast<uint32_t>(num_layers - 1) << lomc::FILE_TEMPORAL_LAYERS_SHIFT) |
+        (static_cast<uint32_t>(format) << lomc::FILE_PIXEL_FORMAT_SHIFT);
+    write_header(0, width, height, file_flags, packed_file);
+
+    // Create the reference frames and the encoder for each plane. The reference frames of the
+    // planes follow the same temporal layer structure.
+    std::vector<lomc::reference_frames> refs;
+    std::vector<plane_encoder> encoders;
+    refs.reserve(static_cast<size_t>(num_planes));
+    encoders.reserve(static_cast<size_t>(num_planes));
+    for (int32_t plane = 0; plane < num_planes; ++plane) {
+      const int32_t plane_width = lomc::plane_size(width, format, plane);
+      const int32_t plane_height = lomc::plane_size(height, format, plane);
+      refs.emplace_back(plane_width, plane_height, num_layers, use_filter);
+      encoders.emplace_back(plane, plane_width, plane_height, num_layers, key_block_period);
+    }
+
+    // Motion vectors for the luma plane, shared by all the planes.
+    const int32_t luma_blocks_per_row = (width + BLOCK_WIDTH - 1) / BLOCK_WIDTH;
+    std::vector<motion_vector> luma_vectors(
+        static_cast<size_t>(lomc::blocks_per_frame(width, height)));
+
+    // The packed size of each plane in the previous frame, used for splitting the frame budget
+    // between the planes (initially in proportion to the number of pixels).
+    int64_t last_plane_bytes[lomc::MAX_PLANES];
+    for (int32_t plane = 0; plane < num_planes; ++plane) {
+      last_plane_bytes[plane] = static_cast<int64_t>(lomc::plane_size(width, format, plane)) *
+                                lomc::plane_size(height, format, plane);
+    }
+
+#ifdef PRINT_TIMING
+    stage_times total_times;
+#endif
+
+    // Pack all images.
+    int64_t total_packed_size = 0;
+    int64_t total_unpacked_size = 0;
+#ifdef DEBUG_PRINT_INFO
+    int64_t total_due_key_blocks = 0;
+    int64_t total_key_blocks = 0;
+#endif
+    int32_t img_no = 0;
+    for (;; ++img_no) {
+      lomc::image* planes[lomc::MAX_PLANES];
+      for (int32_t plane = 0; plane < num_planes; ++plane) {
+        refs[plane].begin_frame(img_no);
+        planes[plane] = &refs[plane].current();
+      }
+      const int32_t layer = refs[0].layer();
+
+      // Load the image.
+      if (reader) {
+        if (!reader->read_frame(planes)) {
+          break;
         }
-#if defined(DEBUG_PRINT_INFO)
-        std::cout << "\n";
+      } else {
+        if (img_no >= static_cast<int32_t>(pgm_files.size())) {
+          break;
+        }
+        planes[0]->load(pgm_files[img_no]);
+        if (planes[0]->width() != width || planes[0]->height() != height) {
+          throw std::runtime_error("Incompatible image dimensions!");
+        }
+      }
+      for (int32_t plane = 0; plane < num_planes; ++plane) {
+        total_unpacked_size +=
+            static_cast<int64_t>(planes[plane]->width()) * planes[plane]->height();
+      }
+
+#ifdef DEBUG_PRINT_INFO
+      std::cout << "Image #" << img_no;
+      if (!reader) {
+        std::cout << ": " << pgm_files[img_no];
+      }
+      std::cout << " (" << width << "x" << height << ")\n";
+#endif
+
+      // Find the blocks that are unchanged since the reference frame according to the dirty
+      // rectangles (if any). Frames that are not listed in the file have no dirty rectangles.
+      if (!dirty_rects_file.empty()) {
+        if (img_no >= static_cast<int32_t>(dirty_rects.size())) {
+          dirty_rects.resize(static_cast<size_t>(img_no) + 1);
+        }
+        for (int32_t plane = 0; plane < num_planes; ++plane) {
+          encoders[plane].set_dirty_rects(dirty_rects[static_cast<size_t>(img_no)]);
+        }
+      }
+      for (int32_t plane = 0; plane < num_planes; ++plane) {
+        encoders[plane].begin_frame(img_no, lomc::plane_subsampling(format, plane));
+      }
+
+      const uint8_t frame_flags =
+          static_cast<uint8_t>(layer << lomc::FRAME_TEMPORAL_LAYER_SHIFT);
+      uint8_t frame_header[lomc::FRAME_HEADER_SIZE];
+
+      // A frame that is identical to its reference frame is coded as a frame header only, and the
+      // filter image is not updated either. Only the blocks that may have changed need to be
+      // compared. If forced key blocks are due in the frame, it is coded as a normal frame with
+      // the key blocks and skip blocks everywhere else instead, so that the key block refresh
+      // goes on through static content.
+      bool unchanged = (img_no > 0);
+      for (int32_t plane = 0; plane < num_planes && unchanged; ++plane) {
+        unchanged = encoders[plane].same_as_reference(*planes[plane], refs[plane].reference());
+      }
+      int32_t num_due_key_blocks = 0;
+      for (int32_t plane = 0; plane < num_planes; ++plane) {
+        num_due_key_blocks += encoders[plane].num_forced_key_blocks(img_no, layer);
+      }
+#ifdef DEBUG_PRINT_INFO
+      total_due_key_blocks += num_due_key_blocks;
+#endif
+      if (unchanged && num_due_key_blocks > 0) {
+        for (int32_t plane = 0; plane < num_planes; ++plane) {
+          encoders[plane].mark_all_clean();
+        }
+      } else if (unchanged) {
+        write_frame_header(lomc::FRAME_HEADER_SIZE,
+                           frame_flags | lomc::FRAME_FLAG_UNCHANGED,
+                           frame_header);
+        packed_file.write(reinterpret_cast<const char*>(frame_header), lomc::FRAME_HEADER_SIZE);
+        total_packed_size += static_cast<int64_t>(lomc::FRAME_HEADER_SIZE);
+#ifdef DEBUG_PRINT_INFO
+        std::cout << "Frame size: " << lomc::FRAME_HEADER_SIZE << " (unchanged)\n";
 #endif
+        if (rate_control) {
+          std::cout << "Frame #" << img_no << ": " << lomc::FRAME_HEADER_SIZE
+                    << " bytes (unchanged)\n";
+          rate_control->end_frame(lomc::FRAME_HEADER_SIZE);
+        }
+        for (int32_t plane = 0; plane < num_planes; ++plane) {
+          refs[plane].end_frame(true);
+        }
+        continue;
       }
 
-      // Append the packed data to the output stream.
-      int32_t packed_frame_size =
-          static_cast<int32_t>(reinterpret_cast<intptr_t>(packed_frame_data_ptr) -
-                               reinterpret_cast<intptr_t>(packed_frame_data.data()));
-      pack_int32(packed_frame_size, &packed_frame_data[0]);
-      packed_file.write(reinterpret_cast<const char*>(packed_frame_data.data()), packed_frame_size);
+#ifdef PRINT_TIMING
+      stage_times frame_times;
+      stage_clock clock;
+      clock.restart();
+#endif
+
+      // The motion search is only done for the luma plane. The chroma planes use scaled versions
+      // of the luma motion vectors.
+#ifdef ENABLE_MOTION_COMPENSATION
+      if (img_no > 0) {
+        motion_search(
+            *planes[0], refs[0].reference(), encoders[0].clean_blocks(), luma_vectors);
+      }
+#endif
+
+#ifdef PRINT_TIMING
+      clock.lap(frame_times.motion_search);
+#endif
+
+      // Rate control: Split the frame budget between the planes, in proportion to their sizes in
+      // the previous frame. The first frame can not be limited (see rate_controller), so it is
+      // coded lossless.
+      plane_budget budgets[lomc::MAX_PLANES];
+      if (rate_control && img_no > 0) {
+        const int32_t header_bytes =
+            lomc::FRAME_HEADER_SIZE + (num_planes * lomc::PLANE_HEADER_SIZE);
+        int64_t total_last_plane_bytes = 0;
+        for (int32_t plane = 0; plane < num_planes; ++plane) {
+          total_last_plane_bytes += last_plane_bytes[plane];
+        }
+        for (int32_t plane = 0; plane < num_planes; ++plane) {
+          budgets[plane].target_bytes = static_cast<int32_t>(
+              (std::max(0, rate_control->target_bytes() - header_bytes) * last_plane_bytes[plane]) /
+              total_last_plane_bytes);
+          budgets[plane].max_bytes = static_cast<int32_t>(
+              (std::max(0, rate_control->max_bytes() - header_bytes) * last_plane_bytes[plane]) /
+              total_last_plane_bytes);
+        }
+      }
+
+      // Encode the planes. The planes are independent of each other (apart from the shared motion
+      // vectors), so the chroma planes are encoded on separate threads.
+      const auto encode_plane = [&](const int32_t plane) {
+        lomc::image* filter_image = nullptr;
+#ifdef ENABLE_FILTER
+        refs[plane].begin_filter();
+        filter_image = &refs[plane].filter_image();
+#endif
+        encoders[plane].encode(img_no,
+                               layer,
+                               *planes[plane],
+                               refs[plane].reference(),
+                               filter_image,
+                               luma_vectors,
+                               luma_blocks_per_row,
+                               lomc::plane_subsampling(format, plane),
+                               budgets[plane]);
+      };
+#ifdef ENABLE_PLANE_THREADS
+      std::vector<std::thread> threads;
+      for (int32_t plane = 1; plane < num_planes; ++plane) {
+        threads.emplace_back(encode_plane, plane);
+      }
+      encode_plane(0);
+      for (auto& thread : threads) {
+        thread.join();
+      }
+#else
+      for (int32_t plane = 0; plane < num_planes; ++plane) {
+        encode_plane(plane);
+      }
+#endif
+
+      // Append the frame header and the packed planes to the output stream.
+      int32_t packed_frame_size = lomc::FRAME_HEADER_SIZE;
+      for (int32_t plane = 0; plane < num_planes; ++plane) {
+        packed_frame_size += encoders[plane].packed_size();
+      }
+      write_frame_header(packed_frame_size, frame_flags, frame_header);
+      packed_file.write(reinterpret_cast<const char*>(frame_header), lomc::FRAME_HEADER_SIZE);
+      for (int32_t plane = 0; plane < num_planes; ++plane) {
+        encoders[plane].write(packed_file);
+      }
       total_packed_size += static_cast<int64_t>(packed_frame_size);
 
+      if (rate_control) {
+        int32_t max_error_bound = 0;
+        int32_t num_dropped_blocks = 0;
+        for (int32_t plane = 0; plane < num_planes; ++plane) {
+          max_error_bound = std::max(max_error_bound, encoders[plane].max_error_bound());
+          num_dropped_blocks += encoders[plane].num_dropped_blocks();
+          last_plane_bytes[plane] = 1 + encoders[plane].packed_size() - lomc::PLANE_HEADER_SIZE;
+        }
+        if (img_no > 0) {
+          std::cout << "Frame #" << img_no << ": " << packed_frame_size << " bytes (target "
+                    << rate_control->target_bytes() << ", max " << rate_control->max_bytes()
+                    << "), error bound " << max_error_bound << ", " << num_dropped_blocks
+                    << " blocks dropped\n";
+        } else {
+          std::cout << "Frame #" << img_no << ": " << packed_frame_size
+                    << " bytes (first frame, lossless)\n";
+        }
+        rate_control->end_frame(packed_frame_size);
+      }
+
 #ifdef DEBUG_PRINT_INFO
+      int32_t total_bits = 0;
+      int32_t total_blocks = 0;
+      for (int32_t plane = 0; plane < num_planes; ++plane) {
+        total_bits += encoders[plane].total_bits();
+        total_blocks += encoders[plane].num_blocks();
+      }
+      for (int32_t plane = 0; plane < num_planes; ++plane) {
+        total_key_blocks += encoders[plane].num_key_blocks();
+      }
       std::cout << "Frame size: " << packed_frame_size << "\n";
       std::cout << "Average bits: "
-                << static_cast<double>(total_bits) / static_cast<double>(num_blocks) << "\n";
-#endif
-
-#ifdef DEBUG_EXPORT_DELTA_IMAGE
-      std::ostringstream delta_file_name;
-      delta_file_name << "out_delta_" << std::setfill('0') << std::setw(4) << img_no << ".pgm";
-      delta.save(delta_file_name.str());
+                << static_cast<double>(total_bits) / static_cast<double>(total_blocks) << "\n";
 #endif
-#ifdef DEBUG_EXPORT_FILTERED_IMAGE
-      std::ostringstream filtered_file_name;
-      filtered_file_name << "out_filt_" << std::setfill('0') << std::setw(4) << img_no << ".pgm";
-      filter_image.save(filtered_file_name.str());
+#ifdef PRINT_TIMING
+      for (int32_t plane = 0; plane < num_planes; ++plane) {
+        frame_times += encoders[plane].times();
+      }
+      frame_times.print("Frame time");
+      total_times += frame_times;
 #endif
+
+      for (int32_t plane = 0; plane < num_planes; ++plane) {
+        encoders[plane].end_frame(refs[plane]);
+      }
+    }
+    if (img_no < 1) {
+      throw std::runtime_error("No input frames.");
     }
 
+    // Fill in the number of frames.
+    packed_file.seekp(0);
+    write_header(img_no, width, height, file_flags, packed_file);
+
 #ifdef DEBUG_PRINT_INFO
-    const int64_t total_unpacked_size =
-        static_cast<int64_t>(num_images) * static_cast<int64_t>(width * height);
     const double compression_ratio =
         static_cast<double>(total_packed_size) / static_cast<double>(total_unpacked_size);
     std::cout << "Compression ratio: " << (100.0 * compression_ratio) << "%\n";
+
+    // Check that the key block refresh was not interrupted (only the rate control may drop forced
+    // key blocks).
+    std::cout << "Forced key blocks: " << total_key_blocks << " of " << total_due_key_blocks
+              << " coded\n";
+#endif
+#ifdef PRINT_TIMING
+    total_times.print("Total time");
 #endif
+    if (rate_control) {
+      rate_control->print_summary();
+    }
 
     // Close the output file.
     packed_file.close();
@@ -0,0 +1,167 @@
+#ifndef FORMAT_HPP_
+#define FORMAT_HPP_
+
+#include <cstdint>
+
+namespace lomc {
+// File header: "LOMC" + version byte, followed by width, height, number of frames and flags (all
+// 32-bit little endian integers).
+const uint8_t FILE_VERSION = 5u;
+const int32_t FILE_HEADER_SIZE = 5 + (4 * 4);
+
+// File header flags.
+const uint32_t FILE_FLAG_FILTER = 0x00000001u;  // Motion compensation uses the filter image.
+const uint32_t FILE_TEMPORAL_LAYERS_MASK = 0x00000300u;  // Number of temporal layers - 1.
+const uint32_t FILE_TEMPORAL_LAYERS_SHIFT = 8u;
+const uint32_t FILE_PIXEL_FORMAT_MASK = 0x000000f0u;  // See pixel_format.
+const uint32_t FILE_PIXEL_FORMAT_SHIFT = 4u;
+
+// Frame header: Packed frame size (including the frame header) and frame flags (8 bits). The frame
+// header is followed by the packed planes (none for an unchanged frame).
+const int32_t FRAME_HEADER_SIZE = 4 + 1;
+
+// Plane header: Size of the packed control data and size of the packed block data (both 32 bits).
+// The plane header is followed by the packed control data and the packed block data.
+const int32_t PLANE_HEADER_SIZE = 4 + 4;
+
+// Frame header flags.
+const uint8_t FRAME_FLAG_UNCHANGED = 0x01u;  // Identical to the reference frame (no frame data).
+const uint8_t FRAME_TEMPORAL_LAYER_MASK = 0x30u;
+const uint8_t FRAME_TEMPORAL_LAYER_SHIFT = 4u;
+
+// Temporal layers: With N temporal layers, every 2^(N-1):th frame belongs to the base layer (layer
+// 0), and the frames in between are split dyadically among the upper layers. A frame in layer
+// L > 0 references the most recent frame in a layer below L, and a base layer frame references the
+// previous base layer frame. Hence the frames in the layers above any given layer can be dropped
+// without decoding them. With a single layer, every frame references the previous frame.
+const int32_t MAX_TEMPORAL_LAYERS = 4;
+
+// Pixel formats. Each plane is coded separately with its own block grid. The chroma planes of
+// YUV 4:2:0 have half the width and height of the luma plane (rounded up), and their motion
+// vectors are derived from the luma motion vectors by the encoder.
+enum pixel_format { PIXEL_FORMAT_GRAY = 0, PIXEL_FORMAT_YUV420 = 1 };
+const int32_t MAX_PLANES = 3;
+
+const int32_t BLOCK_WIDTH = 16;
+const int32_t BLOCK_HEIGHT = 8;
+const int32_t FRAMES_BETWEEN_FORCED_KEY_BLOCK = 32;
+
+const int32_t MOTION_DELTA_MIN = -8;
+const int32_t MOTION_DELTA_MAX = 7;
+
+enum block_type { BLOCK_DELTA_FRAME = 0, BLOCK_DELTA_ROW = 1, BLOCK_COPY = 2 };
+
+// Control byte layout: bits 0-3 = number of bits per delta, bits 4-5 = block type, bit 6 = run,
+// bit 7 = the block has a motion compensated reference. Motion compensated blocks are preceded by
+// a motion byte in the packed data stream: bits 0-3 = dx - MOTION_DELTA_MIN, bits 4-7 =
+// dy - MOTION_DELTA_MIN.
+const uint8_t CONTROL_NUM_BITS_MASK = 0x0fu;
+const uint8_t CONTROL_BLOCK_TYPE_MASK = 0x30u;
+const uint8_t CONTROL_BLOCK_TYPE_SHIFT = 4u;
+const uint8_t CONTROL_RUN = 0x40u;
+const uint8_t CONTROL_MOTION = 0x80u;
+
+// A control byte with CONTROL_RUN set is followed by a byte holding the run length minus
+// MIN_CONTROL_RUN, and applies to that many consecutive blocks.
+const int32_t MIN_CONTROL_RUN = 2;
+const int32_t MAX_CONTROL_RUN = MIN_CONTROL_RUN + 255;
+
+// A skip block (a 0-bit frame delta without motion) is identical to the co-located block in the
+// reference frame, and does not change the filter image.
+const uint8_t CONTROL_SKIP = static_cast<uint8_t>(BLOCK_DELTA_FRAME << CONTROL_BLOCK_TYPE_SHIFT);
+
+inline int32_t round_up(const int32_t x, const int32_t round_to) {
+  return round_to * ((x + round_to - 1) / round_to);
+}
+
+inline int32_t blocks_per_frame(const int32_t width, const int32_t height) {
+  return ((width + BLOCK_WIDTH - 1) / BLOCK_WIDTH) * ((height + BLOCK_HEIGHT - 1) / BLOCK_HEIGHT);
+}
+
+inline int32_t num_planes(const pixel_format format) {
+  return (format == PIXEL_FORMAT_YUV420) ? 3 : 1;
+}
+
+// Subsampling of a plane, as a power of two (the same horizontally and vertically).
+inline int32_t plane_subsampling(const pixel_format format, const int32_t plane) {
+  return (format == PIXEL_FORMAT_YUV420 && plane > 0) ? 1 : 0;
+}
+
+// The width or height of a plane, given the width or height of the frame.
+inline int32_t plane_size(const int32_t size, const pixel_format format, const int32_t plane) {
+  const int32_t subsampling = plane_subsampling(format, plane);
+  return (size + (1 << subsampling) - 1) >> subsampling;
+}
+
+// Upper bound for the size of a packed plane: At most one control byte and one motion byte per
+// block, plus uncompressed pixel data.
+inline int32_t max_packed_plane_size(const int32_t width, const int32_t height) {
+  return PLANE_HEADER_SIZE + (2 * blocks_per_frame(width, height)) +
+         (round_up(width, BLOCK_WIDTH) * height);
+}
+
+inline int32_t max_packed_frame_size(const int32_t width,
+                                     const int32_t height,
+                                     const pixel_format format) {
+  int32_t size = FRAME_HEADER_SIZE;
+  for (int32_t plane = 0; plane < num_planes(format); ++plane) {
+    size += max_packed_plane_size(plane_size(width, format, plane),
+                                  plane_size(height, format, plane));
+  }
+  return size;
+}
+
+inline int32_t temporal_layer(const int32_t frame_no, const int32_t num_layers) {
+  int32_t layer = num_layers - 1;
+  for (int32_t n = frame_no; layer > 0 && (n & 1) == 0; n >>= 1) {
+    --layer;
+  }
+  return layer;
+}
+
+// The layer of the reference frame for a frame in the given layer.
+inline int32_t reference_layer(const int32_t layer) {
+  return (layer > 0) ? (layer - 1) : 0;
+}
+
+// Frames in the top layer are never used as references (unless there is only a single layer).
+inline bool is_reference_layer(const int32_t layer, const int32_t num_layers) {
+  return (layer == 0) || (layer < num_layers - 1);
+}
+
+// The number of the frame that a frame (other than the first one) is predicted from, i.e. the
+// most recent earlier frame in a layer up to the reference layer.
+inline int32_t reference_frame_no(const int32_t frame_no, const int32_t num_layers) {
+  const int32_t ref_layer = reference_layer(temporal_layer(frame_no, num_layers));
+  int32_t ref_frame_no = frame_no - 1;
+  while (ref_frame_no > 0 && temporal_layer(ref_frame_no, num_layers) > ref_layer) {
+    --ref_frame_no;
+  }
+  return ref_frame_no;
+}
+
+inline uint8_t pack_motion(const int32_t dx, const int32_t dy) {
+  return static_cast<uint8_t>((dx - MOTION_DELTA_MIN) | ((dy - MOTION_DELTA_MIN) << 4));
+}
+
+inline void unpack_motion(const uint8_t motion, int32_t& dx, int32_t& dy) {
+  dx = static_cast<int32_t>(motion & 0x0fu) + MOTION_DELTA_MIN;
+  dy = static_cast<int32_t>(motion >> 4) + MOTION_DELTA_MIN;
+}
+
+inline void pack_int32(const int32_t x, uint8_t* data) {
+  data[0] = static_cast<uint8_t>(x);
+  data[1] = static_cast<uint8_t>(x >> 8);
+  data[2] = static_cast<uint8_t>(x >> 16);
+  data[3] = static_cast<uint8_t>(x >> 24);
+}
+
+inline int32_t unpack_int32(const uint8_t* data) {
+  return static_cast<int32_t>(static_cast<uint32_t>(data[0]) |
+                              (static_cast<uint32_t>(data[1]) << 8) |
+                              (static_cast<uint32_t>(data[2]) << 16) |
+                              (static_cast<uint32_t>(data[3]) << 24));
+}
+}  // namespace lomc
+
+#endif  // FORMAT_HPP_
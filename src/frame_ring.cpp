@@ -0,0 +1,176 @@
+#include "frame_ring.hpp"
+
+#include <atomic>
+#include <new>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static_assert(ATOMIC_INT_LOCK_FREE == 2 && ATOMIC_LLONG_LOCK_FREE == 2,
+              "The frame ring requires lock free 32-bit and 64-bit atomics");
+
+namespace lomc {
+namespace {
+const uint32_t RING_MAGIC = 0x434d4f4cu;  // "LOMC"
+
+// Slots (and rows) are aligned to cache lines.
+const int32_t RING_ALIGNMENT = 64;
+
+int32_t align(const int32_t x) {
+  return RING_ALIGNMENT * ((x + RING_ALIGNMENT - 1) / RING_ALIGNMENT);
+}
+}  // namespace
+
+struct frame_ring::ring_header {
+  // Written last by the producer (release) and read first by the consumer (acquire), so that the
+  // consumer sees the initialized header once the magic matches.
+  std::atomic<uint32_t> magic;
+  int32_t width;
+  int32_t height;
+  int32_t stride;
+  int32_t num_slots;
+  int32_t slot_size;
+
+  // The counters are kept in separate cache lines, since they are written by different processes.
+  alignas(RING_ALIGNMENT) std::atomic<uint64_t> write_count;
+  alignas(RING_ALIGNMENT) std::atomic<uint64_t> read_count;
+};
+
+struct alignas(RING_ALIGNMENT) frame_ring::slot_header {
+  int64_t timestamp;
+};
+
+frame_ring::frame_ring(const std::string& name,
+                       const int32_t width,
+                       const int32_t height,
+                       const int32_t num_slots)
+    : name_(name), owner_(true), mem_(nullptr), mem_size_(0), header_(nullptr) {
+  if (width < 1 || height < 1 || num_slots < 1) {
+    throw std::runtime_error("Invalid frame ring dimensions");
+  }
+  const int32_t stride = align(width);
+  const int32_t slot_size = static_cast<int32_t>(sizeof(slot_header)) + (stride * height);
+  const size_t size = sizeof(ring_header) + (static_cast<size_t>(slot_size) * num_slots);
+
+  const int fd = shm_open(name_.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+  if (fd < 0) {
+    throw std::runtime_error("Failed to create shared memory " + name_);
+  }
+  if (ftruncate(fd, static_cast<off_t>(size)) != 0) {
+    close(fd);
+    shm_unlink(name_.c_str());
+    throw std::runtime_error("Failed to resize shared memory");
+  }
+  try {
+    map(fd, size);
+  } catch (...) {
+    shm_unlink(name_.c_str());
+    throw;
+  }
+
+  header_ = new (mem_) ring_header();
+  header_->width = width;
+  header_->height = height;
+  header_->stride = stride;
+  header_->num_slots = num_slots;
+  header_->slot_size = slot_size;
+  header_->write_count.store(0u, std::memory_order_relaxed);
+  header_->read_count.store(0u, std::memory_order_relaxed);
+  header_->magic.store(RING_MAGIC, std::memory_order_release);
+}
+
+frame_ring::frame_ring(const std::string& name)
+    : name_(name), owner_(false), mem_(nullptr), mem_size_(0), header_(nullptr) {
+  const int fd = shm_open(name_.c_str(), O_RDWR, 0600);
+  if (fd < 0) {
+    throw std::runtime_error("Failed to open shared memory " + name_);
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(ring_header)) {
+    close(fd);
+    throw std::runtime_error("Invalid frame ring");
+  }
+  map(fd, static_cast<size_t>(st.st_size));
+
+  header_ = static_cast<ring_header*>(mem_);
+  if (header_->magic.load(std::memory_order_acquire) != RING_MAGIC ||
+      sizeof(ring_header) + (static_cast<size_t>(header_->slot_size) * header_->num_slots) >
+          mem_size_) {
+    munmap(mem_, mem_size_);
+    throw std::runtime_error("Invalid frame ring");
+  }
+}
+
+frame_ring::~frame_ring() {
+  munmap(mem_, mem_size_);
+  if (owner_) {
+    shm_unlink(name_.c_str());
+  }
+}
+
+void frame_ring::map(const int fd, const size_t size) {
+  void* mem = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (mem == MAP_FAILED) {
+    throw std::runtime_error("Failed to map shared memory");
+  }
+  mem_ = mem;
+  mem_size_ = size;
+}
+
+frame_ring::slot_header* frame_ring::slot(const uint64_t count) const {
+  const size_t slot_no = static_cast<size_t>(count % static_cast<uint64_t>(header_->num_slots));
+  uint8_t* slots = static_cast<uint8_t*>(mem_) + sizeof(ring_header);
+  return reinterpret_cast<slot_header*>(slots + (slot_no * header_->slot_size));
+}
+
+uint8_t* frame_ring::try_begin_write() {
+  const uint64_t write_count = header_->write_count.load(std::memory_order_relaxed);
+  const uint64_t read_count = header_->read_count.load(std::memory_order_acquire);
+  if (write_count - read_count >= static_cast<uint64_t>(header_->num_slots)) {
+    return nullptr;
+  }
+  return reinterpret_cast<uint8_t*>(slot(write_count) + 1);
+}
+
+void frame_ring::end_write(const int64_t timestamp) {
+  const uint64_t write_count = header_->write_count.load(std::memory_order_relaxed);
+  slot(write_count)->timestamp = timestamp;
+  header_->write_count.store(write_count + 1u, std::memory_order_release);
+}
+
+const uint8_t* frame_ring::try_begin_read(int64_t& timestamp) {
+  const uint64_t read_count = header_->read_count.load(std::memory_order_relaxed);
+  const uint64_t write_count = header_->write_count.load(std::memory_order_acquire);
+  if (read_count == write_count) {
+    return nullptr;
+  }
+  const slot_header* s = slot(read_count);
+  timestamp = s->timestamp;
+  return reinterpret_cast<const uint8_t*>(s + 1);
+}
+
+void frame_ring::end_read() {
+  const uint64_t read_count = header_->read_count.load(std::memory_order_relaxed);
+  header_->read_count.store(read_count + 1u, std::memory_order_release);
+}
+
+int32_t frame_ring::width() const {
+  return header_->width;
+}
+
+int32_t frame_ring::height() const {
+  return header_->height;
+}
+
+int32_t frame_ring::stride() const {
+  return header_->stride;
+}
+
+int32_t frame_ring::num_slots() const {
+  return header_->num_slots;
+}
+}  // namespace lomc
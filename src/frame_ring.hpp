@@ -0,0 +1,63 @@
+#ifndef FRAME_RING_HPP_
+#define FRAME_RING_HPP_
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace lomc {
+// A ring of frame slots in POSIX shared memory, for handing decoded frames from a producer
+// process to a consumer process without copying them: The producer decodes straight into a slot
+// and the consumer reads the pixels from its own mapping of the same slot.
+//
+// The handoff is lock free, with one producer and one consumer. Each side only writes its own
+// counter (number of published and released frames, respectively) in the shared header.
+class frame_ring {
+public:
+  // Create a new ring (producer side). The ring is removed when the creating object is destroyed.
+  frame_ring(const std::string& name,
+             const int32_t width,
+             const int32_t height,
+             const int32_t num_slots);
+
+  // Open an existing ring (consumer side).
+  explicit frame_ring(const std::string& name);
+
+  ~frame_ring();
+
+  frame_ring(const frame_ring&) = delete;
+  frame_ring& operator=(const frame_ring&) = delete;
+
+  // Producer: Get the pixels of the next free slot, or nullptr if all slots are in use.
+  uint8_t* try_begin_write();
+
+  // Producer: Publish the slot that was returned by try_begin_write().
+  void end_write(const int64_t timestamp);
+
+  // Consumer: Get the pixels of the oldest published slot, or nullptr if there is none.
+  const uint8_t* try_begin_read(int64_t& timestamp);
+
+  // Consumer: Release the slot that was returned by try_begin_read().
+  void end_read();
+
+  int32_t width() const;
+  int32_t height() const;
+  int32_t stride() const;
+  int32_t num_slots() const;
+
+private:
+  struct ring_header;
+  struct slot_header;
+
+  void map(const int fd, const size_t size);
+  slot_header* slot(const uint64_t count) const;
+
+  std::string name_;
+  bool owner_;
+  void* mem_;
+  size_t mem_size_;
+  ring_header* header_;
+};
+}  // namespace lomc
+
+#endif  // FRAME_RING_HPP_
@@ -0,0 +1,268 @@
+#ifndef PACKBITS_HPP_
+#define PACKBITS_HPP_
+
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+
+namespace lomc {
+// Deltas are packed in rows of 16 values, using 1, 2, 4 or 8 bits per value. For less than 8 bits
+// per value, the (signed) deltas are offset by get_value_offset() to make them unsigned.
+inline uint8_t get_value_offset(const uint8_t num_bits) {
+  static const uint8_t value_offset_tab[9] = {0u, 1u, 2u, 0u, 8u, 0u, 0u, 0u, 0u};
+  return value_offset_tab[num_bits];
+}
+
+inline void apply_offset(const uint8_t num_bits, uint8_t* unpacked) {
+  const uint8_t offset = get_value_offset(num_bits);
+  if (offset > 0u) {
+    for (int i = 0; i < 16; ++i) {
+      unpacked[i] += offset;
+      if (num_bits < 8u && (unpacked[i] & 0x80u)) {
+        std::flush(std::cout);
+        throw std::runtime_error("WTF?!");
+      }
+    }
+  }
+}
+
+inline void packbits_1(const uint8_t* unpacked, uint8_t*& packed) {
+  // Read 16 bytes.
+  const uint32_t* src = reinterpret_cast<const uint32_t*>(unpacked);
+  uint32_t s1 = src[0];
+  uint32_t s2 = src[1];
+  uint32_t s3 = src[2];
+  uint32_t s4 = src[3];
+
+  // Combine into a single 16-bit word.
+  static const uint32_t mask1 = 0x01000000u;
+  static const uint32_t mask2 = 0x00010000u;
+  static const uint32_t mask3 = 0x00000100u;
+  static const uint32_t mask4 = 0x00000001u;
+  uint32_t d = ((s1 & mask1) >> 9) | ((s1 & mask2) >> 2) | ((s1 & mask3) << 5) |
+               ((s1 & mask4) << 12) | ((s2 & mask1) >> 13) | ((s2 & mask2) >> 6) |
+               ((s2 & mask3) << 1) | ((s2 & mask4) << 8) | ((s3 & mask1) >> 17) |
+               ((s3 & mask2) >> 10) | ((s3 & mask3) >> 3) | ((s3 & mask4) << 4) |
+               ((s4 & mask1) >> 21) | ((s4 & mask2) >> 14) | ((s4 & mask3) >> 7) | (s4 & mask4);
+
+  // Write 2 bytes.
+  uint16_t* dst = reinterpret_cast<uint16_t*>(packed);
+  dst[0] = static_cast<uint16_t>(d);
+  packed += 2;
+}
+
+inline void packbits_2(const uint8_t* unpacked, uint8_t*& packed) {
+  // Read 16 bytes.
+  const uint32_t* src = reinterpret_cast<const uint32_t*>(unpacked);
+  uint32_t s1 = src[0];
+  uint32_t s2 = src[1];
+  uint32_t s3 = src[2];
+  uint32_t s4 = src[3];
+
+  // Combine into a single 32-bit word.
+  static const uint32_t mask1 = 0x03000000u;
+  static const uint32_t mask2 = 0x00030000u;
+  static const uint32_t mask3 = 0x00000300u;
+  static const uint32_t mask4 = 0x00000003u;
+  uint32_t d = ((s1 & mask1) << 6) | ((s1 & mask2) << 12) | ((s1 & mask3) << 18) |
+               ((s1 & mask4) << 24) | ((s2 & mask1) >> 2) | ((s2 & mask2) << 4) |
+               ((s2 & mask3) << 10) | ((s2 & mask4) << 16) | ((s3 & mask1) >> 10) |
+               ((s3 & mask2) >> 4) | ((s3 & mask3) << 2) | ((s3 & mask4) << 8) |
+               ((s4 & mask1) >> 18) | ((s4 & mask2) >> 12) | ((s4 & mask3) >> 6) | (s4 & mask4);
+
+  // Write 4 bytes.
+  uint32_t* dst = reinterpret_cast<uint32_t*>(packed);
+  dst[0] = d;
+  packed += 4;
+}
+
+inline void packbits_4(const uint8_t* unpacked, uint8_t*& packed) {
+  // Read 16 bytes.
+  const uint32_t* src = reinterpret_cast<const uint32_t*>(unpacked);
+  uint32_t s1 = src[0];
+  uint32_t s2 = src[1];
+  uint32_t s3 = src[2];
+  uint32_t s4 = src[3];
+
+  // Combine into two 32-bit words.
+  static const uint32_t mask1 = 0x0f000000u;
+  static const uint32_t mask2 = 0x000f0000u;
+  static const uint32_t mask3 = 0x00000f00u;
+  static const uint32_t mask4 = 0x0000000fu;
+  uint32_t d1 = ((s1 & mask1) << 4) | ((s1 & mask2) << 8) | ((s1 & mask3) << 12) |
+                ((s1 & mask4) << 16) | ((s2 & mask1) >> 12) | ((s2 & mask2) >> 8) |
+                ((s2 & mask3) >> 4) | (s2 & mask4);
+  uint32_t d2 = ((s3 & mask1) << 4) | ((s3 & mask2) << 8) | ((s3 & mask3) << 12) |
+                ((s3 & mask4) << 16) | ((s4 & mask1) >> 12) | ((s4 & mask2) >> 8) |
+                ((s4 & mask3) >> 4) | (s4 & mask4);
+
+  // Write 8 bytes.
+  uint32_t* dst = reinterpret_cast<uint32_t*>(packed);
+  dst[0] = d1;
+  dst[1] = d2;
+  packed += 8;
+}
+
+inline void packbits_8(const uint8_t* unpacked, uint8_t*& packed) {
+  // Copy 16 bytes.
+  const uint32_t* src = reinterpret_cast<const uint32_t*>(unpacked);
+  uint32_t* dst = reinterpret_cast<uint32_t*>(packed);
+  dst[0] = src[0];
+  dst[1] = src[1];
+  dst[2] = src[2];
+  dst[3] = src[3];
+  packed += 16;
+}
+
+inline void unpackbits_1(const uint8_t*& packed, uint8_t* unpacked) {
+  // Read 2 bytes.
+  const uint16_t* src = reinterpret_cast<const uint16_t*>(packed);
+  uint32_t s1 = static_cast<uint32_t>(src[0]);
+  packed += 2;
+
+  // Split into four 32-bit words.
+  static const uint32_t mask1 = 0x01000000u;
+  static const uint32_t mask2 = 0x00010000u;
+  static const uint32_t mask3 = 0x00000100u;
+  static const uint32_t mask4 = 0x00000001u;
+  uint32_t d1 = ((s1 << 9) & mask1) | ((s1 << 2) & mask2) | ((s1 >> 5) & mask3) |
+                ((s1 >> 12) & mask4);
+  uint32_t d2 = ((s1 << 13) & mask1) | ((s1 << 6) & mask2) | ((s1 >> 1) & mask3) |
+                ((s1 >> 8) & mask4);
+  uint32_t d3 = ((s1 << 17) & mask1) | ((s1 << 10) & mask2) | ((s1 << 3) & mask3) |
+                ((s1 >> 4) & mask4);
+  uint32_t d4 = ((s1 << 21) & mask1) | ((s1 << 14) & mask2) | ((s1 << 7) & mask3) | (s1 & mask4);
+
+  // Write 16 bytes.
+  uint32_t* dst = reinterpret_cast<uint32_t*>(unpacked);
+  dst[0] = d1;
+  dst[1] = d2;
+  dst[2] = d3;
+  dst[3] = d4;
+}
+
+inline void unpackbits_2(const uint8_t*& packed, uint8_t* unpacked) {
+  // Read 4 bytes.
+  const uint32_t* src = reinterpret_cast<const uint32_t*>(packed);
+  uint32_t s1 = src[0];
+  packed += 4;
+
+  // Split into four 32-bit words.
+  static const uint32_t mask1 = 0x03000000u;
+  static const uint32_t mask2 = 0x00030000u;
+  static const uint32_t mask3 = 0x00000300u;
+  static const uint32_t mask4 = 0x00000003u;
+  uint32_t d1 = ((s1 >> 6) & mask1) | ((s1 >> 12) & mask2) | ((s1 >> 18) & mask3) |
+                ((s1 >> 24) & mask4);
+  uint32_t d2 = ((s1 << 2) & mask1) | ((s1 >> 4) & mask2) | ((s1 >> 10) & mask3) |
+                ((s1 >> 16) & mask4);
+  uint32_t d3 = ((s1 << 10) & mask1) | ((s1 << 4) & mask2) | ((s1 >> 2) & mask3) |
+                ((s1 >> 8) & mask4);
+  uint32_t d4 = ((s1 << 18) & mask1) | ((s1 << 12) & mask2) | ((s1 << 6) & mask3) | (s1 & mask4);
+
+  // Write 16 bytes.
+  uint32_t* dst = reinterpret_cast<uint32_t*>(unpacked);
+  dst[0] = d1;
+  dst[1] = d2;
+  dst[2] = d3;
+  dst[3] = d4;
+}
+
+inline void unpackbits_4(const uint8_t*& packed, uint8_t* unpacked) {
+  // Read 8 bytes.
+  const uint32_t* src = reinterpret_cast<const uint32_t*>(packed);
+  uint32_t s1 = src[0];
+  uint32_t s2 = src[1];
+  packed += 8;
+
+  // Split into four 32-bit words.
+  static const uint32_t mask1 = 0x0f000000u;
+  static const uint32_t mask2 = 0x000f0000u;
+  static const uint32_t mask3 = 0x00000f00u;
+  static const uint32_t mask4 = 0x0000000fu;
+  uint32_t d1 = ((s1 >> 4) & mask1) | ((s1 >> 8) & mask2) | ((s1 >> 12) & mask3) |
+                ((s1 >> 16) & mask4);
+  uint32_t d2 = ((s1 << 12) & mask1) | ((s1 << 8) & mask2) | ((s1 << 4) & mask3) | (s1 & mask4);
+  uint32_t d3 = ((s2 >> 4) & mask1) | ((s2 >> 8) & mask2) | ((s2 >> 12) & mask3) |
+                ((s2 >> 16) & mask4);
+  uint32_t d4 = ((s2 << 12) & mask1) | ((s2 << 8) & mask2) | ((s2 << 4) & mask3) | (s2 & mask4);
+
+  // Write 16 bytes.
+  uint32_t* dst = reinterpret_cast<uint32_t*>(unpacked);
+  dst[0] = d1;
+  dst[1] = d2;
+  dst[2] = d3;
+  dst[3] = d4;
+}
+
+inline void unpackbits_8(const uint8_t*& packed, uint8_t* unpacked) {
+  // Copy 16 bytes.
+  const uint32_t* src = reinterpret_cast<const uint32_t*>(packed);
+  uint32_t* dst = reinterpret_cast<uint32_t*>(unpacked);
+  dst[0] = src[0];
+  dst[1] = src[1];
+  dst[2] = src[2];
+  dst[3] = src[3];
+  packed += 16;
+}
+
+// Pack one row of 16 deltas using num_bits bits per delta. Note: The offset is applied in place.
+inline void pack_row(const uint8_t num_bits, uint8_t* unpacked, uint8_t*& packed) {
+  apply_offset(num_bits, unpacked);
+  switch (num_bits) {
+    case 1u:
+      packbits_1(unpacked, packed);
+      break;
+    case 2u:
+      packbits_2(unpacked, packed);
+      break;
+    case 4u:
+      packbits_4(unpacked, packed);
+      break;
+    case 8u:
+      packbits_8(unpacked, packed);
+      break;
+    case 0u:
+      break;
+    default:
+      throw std::runtime_error("Invalid num_bits");
+  }
+}
+
+inline void remove_offset(const uint8_t num_bits, uint8_t* unpacked) {
+  const uint8_t offset = get_value_offset(num_bits);
+  if (offset > 0u) {
+    for (int i = 0; i < 16; ++i) {
+      unpacked[i] -= offset;
+    }
+  }
+}
+
+// Unpack one row of 16 deltas that were packed with num_bits bits per delta.
+inline void unpack_row(const uint8_t num_bits, const uint8_t*& packed, uint8_t* unpacked) {
+  switch (num_bits) {
+    case 1u:
+      unpackbits_1(packed, unpacked);
+      break;
+    case 2u:
+      unpackbits_2(packed, unpacked);
+      break;
+    case 4u:
+      unpackbits_4(packed, unpacked);
+      break;
+    case 8u:
+      unpackbits_8(packed, unpacked);
+      break;
+    case 0u:
+      std::memset(unpacked, 0, 16);
+      return;
+    default:
+      throw std::runtime_error("Invalid num_bits");
+  }
+  remove_offset(num_bits, unpacked);
+}
+
+}  // namespace lomc
+
+#endif  // PACKBITS_HPP_
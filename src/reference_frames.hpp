@@ -0,0 +1,161 @@
+#ifndef REFERENCE_FRAMES_HPP_
+#define REFERENCE_FRAMES_HPP_
+
+#include "format.hpp"
+#include "image.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <stdexcept>
+#include <vector>
+
+namespace lomc {
+// Reference frame bookkeeping for the temporal layer structure (see format.hpp), shared by the
+// encoder and the decoder.
+//
+// Each reference slot holds the most recent frame in layer m or below (along with the filter image
+// that was produced when coding that frame). The slots refer to a small pool of frame buffers, so
+// that several slots can share the same frame without copying it.
+//
+// Usage: begin_frame(), then (unless the frame is unchanged) begin_filter(), code the frame into
+// current() and filter_image(), and finally end_frame(). Alternatively, if can_update_in_place(),
+// the frame can be written into reference_in_place() (e.g. only the parts that changed) and stored
+// with end_frame_in_place().
+class reference_frames {
+public:
+  reference_frames(const int32_t width,
+                   const int32_t height,
+                   const int32_t num_layers,
+                   const bool use_filter)
+      : buffers_(static_cast<size_t>(num_layers + 1)),
+        slots_(static_cast<size_t>(std::max(num_layers - 1, 1)), 0),
+        num_layers_(num_layers),
+        use_filter_(use_filter),
+        layer_(0),
+        ref_(0),
+        cur_(1),
+        in_place_(false) {
+    if (num_layers < 1 || num_layers > MAX_TEMPORAL_LAYERS) {
+      throw std::runtime_error("Invalid number of temporal layers");
+    }
+    for (size_t i = 0; i < buffers_.size(); ++i) {
+      buffers_[i].img = image(width, height);
+      if (use_filter_) {
+        buffers_[i].filter = image(width, height);
+      }
+    }
+  }
+
+  // Select the reference frame and a free buffer for the current frame.
+  void begin_frame(const int32_t frame_no) {
+    layer_ = temporal_layer(frame_no, num_layers_);
+    ref_ = slots_[static_cast<size_t>(reference_layer(layer_))];
+    for (cur_ = 0; is_referenced(cur_); ++cur_) {
+    }
+
+    // The buffers of the reference frame (at least the filter image) can be updated in place if
+    // no other slot refers to the reference frame once the current frame has been stored (e.g.
+    // always for the base layer).
+    in_place_ = is_reference_layer(layer_, num_layers_);
+    for (size_t m = 0; m < slots_.size(); ++m) {
+      if (slots_[m] == ref_ && !replaces_slot(static_cast<int32_t>(m))) {
+        in_place_ = false;
+      }
+    }
+  }
+
+  // Prepare the filter image for the current frame (starting out as the filter image of the
+  // reference frame). Returns the number of pixels that had to be copied (zero when the filter
+  // image is updated in place).
+  int64_t begin_filter() {
+    if (!use_filter_ || in_place_) {
+      return 0;
+    }
+    const image& filter = buffers_[ref_].filter;
+    buffers_[cur_].filter = filter;
+    return static_cast<int64_t>(filter.width()) * filter.height();
+  }
+
+  // Store the current frame in the reference slots (if it is in a reference layer). An unchanged
+  // frame shares the buffers of its reference frame.
+  void end_frame(const bool unchanged) {
+    if (!unchanged && in_place_) {
+      std::swap(buffers_[cur_].filter, buffers_[ref_].filter);
+    }
+    store_frame(unchanged ? ref_ : cur_);
+  }
+
+  // Store the current frame, which has been written into reference_in_place() rather than
+  // current().
+  void end_frame_in_place() {
+    assert(in_place_);
+    store_frame(ref_);
+  }
+
+  // The current frame is stored in a reference slot.
+  bool is_stored() const {
+    return is_reference_layer(layer_, num_layers_);
+  }
+
+  // The current frame can be coded straight into the buffers of the reference frame, since the
+  // reference frame is not needed after the current frame.
+  bool can_update_in_place() const {
+    return in_place_;
+  }
+
+  int32_t layer() const {
+    return layer_;
+  }
+
+  const image& reference() const {
+    return buffers_[ref_].img;
+  }
+
+  image& current() {
+    return buffers_[cur_].img;
+  }
+
+  image& reference_in_place() {
+    assert(in_place_);
+    return buffers_[ref_].img;
+  }
+
+  image& filter_image() {
+    return in_place_ ? buffers_[ref_].filter : buffers_[cur_].filter;
+  }
+
+private:
+  struct frame_buffer {
+    image img;
+    image filter;
+  };
+
+  bool is_referenced(const int32_t buffer) const {
+    return std::find(slots_.begin(), slots_.end(), buffer) != slots_.end();
+  }
+
+  void store_frame(const int32_t frame_buffer) {
+    for (size_t m = 0; m < slots_.size(); ++m) {
+      if (replaces_slot(static_cast<int32_t>(m))) {
+        slots_[m] = frame_buffer;
+      }
+    }
+  }
+
+  bool replaces_slot(const int32_t m) const {
+    return is_reference_layer(layer_, num_layers_) && m >= layer_;
+  }
+
+  std::vector<frame_buffer> buffers_;
+  std::vector<int32_t> slots_;
+  const int32_t num_layers_;
+  const bool use_filter_;
+  int32_t layer_;
+  int32_t ref_;
+  int32_t cur_;
+  bool in_place_;
+};
+}  // namespace lomc
+
+#endif  // REFERENCE_FRAMES_HPP_
@@ -0,0 +1,60 @@
+# Encode a synthetic clip with the demo encoder, decode it again and check that the round trip is
+# lossless. The clip is also encoded at the next multiple of the block width, and the packed size
+# of the (cropped) clip must not be larger than that.
+#
+# Variables: DEMO, DECODE_DEMO, MAKE_TEST_CLIP, WIDTH, HEIGHT, FRAMES, WORK_DIR.
+
+function(run)
+  execute_process(COMMAND ${ARGN} WORKING_DIRECTORY ${dir} RESULT_VARIABLE result OUTPUT_QUIET)
+  if(NOT result EQUAL 0)
+    message(FATAL_ERROR "Failed (${result}): ${ARGN}")
+  endif()
+endfunction()
+
+# Encode and decode a clip of the given width. Sets packed_size in the parent scope.
+function(round_trip width)
+  set(dir ${WORK_DIR}/${width})
+  file(REMOVE_RECURSE ${dir})
+  file(MAKE_DIRECTORY ${dir})
+  run(${MAKE_TEST_CLIP} ${width} ${HEIGHT} ${FRAMES} in)
+
+  set(frames)
+  math(EXPR last_frame "${FRAMES} - 1")
+  foreach(frame_no RANGE ${last_frame})
+    string(LENGTH "000${frame_no}" length)
+    math(EXPR start "${length} - 4")
+    string(SUBSTRING "000${frame_no}" ${start} 4 frame_no)
+    list(APPEND frames ${frame_no})
+  endforeach()
+
+  set(inputs)
+  foreach(frame_no ${frames})
+    list(APPEND inputs in_${frame_no}.pgm)
+  endforeach()
+  run(${DEMO} ${inputs})
+  run(${DECODE_DEMO} packed.lmc)
+  foreach(frame_no ${frames})
+    execute_process(COMMAND ${CMAKE_COMMAND} -E compare_files
+                            ${dir}/in_${frame_no}.pgm ${dir}/out_dec_${frame_no}.pgm
+                    RESULT_VARIABLE result)
+    if(NOT result EQUAL 0)
+      message(FATAL_ERROR "Frame ${frame_no} of the ${width} pixel wide clip differs")
+    endif()
+  endforeach()
+
+  file(READ ${dir}/packed.lmc packed HEX)
+  string(LENGTH "${packed}" length)
+  math(EXPR length "${length} / 2")
+  set(packed_size ${length} PARENT_SCOPE)
+endfunction()
+
+round_trip(${WIDTH})
+set(size ${packed_size})
+math(EXPR padded_width "((${WIDTH} + 15) / 16) * 16")
+round_trip(${padded_width})
+message(STATUS "Packed size: ${size} bytes (${WIDTH} pixels wide), "
+               "${packed_size} bytes (${padded_width} pixels wide)")
+if(size GREATER packed_size)
+  message(FATAL_ERROR "The ${WIDTH} pixel wide clip packs worse than the ${padded_width} pixel "
+                      "wide clip")
+endif()
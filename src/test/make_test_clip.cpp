@@ -0,0 +1,52 @@
+#include "image.hpp"
+
+#include <cmath>
+#include <cstdint>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+
+namespace {
+// A smooth pattern with some sharp edges, so that both the motion search and the frame deltas have
+// something to work with.
+uint8_t pattern(const int32_t u, const int32_t v) {
+  const double smooth = 96.0 + (64.0 * std::sin(0.11 * u) * std::cos(0.07 * v));
+  const bool is_edge = ((u / 24) + (v / 16)) % 3 == 0;
+  return static_cast<uint8_t>(smooth + (is_edge ? 64.0 : 0.0));
+}
+}  // namespace
+
+// Usage: make_test_clip WIDTH HEIGHT FRAMES PREFIX
+//
+// Write a clip of gray PGM images (PREFIX_0000.pgm, PREFIX_0001.pgm, ...) that pan across a
+// synthetic pattern. Clips of different widths show the same content, cropped.
+int main(int argc, const char** argv) {
+  try {
+    if (argc != 5) {
+      throw std::runtime_error("Usage: make_test_clip WIDTH HEIGHT FRAMES PREFIX");
+    }
+    const int32_t width = std::stoi(argv[1]);
+    const int32_t height = std::stoi(argv[2]);
+    const int32_t num_frames = std::stoi(argv[3]);
+    const std::string prefix = argv[4];
+
+    lomc::image img(width, height);
+    for (int32_t frame_no = 0; frame_no < num_frames; ++frame_no) {
+      for (int32_t y = 0; y < height; ++y) {
+        for (int32_t x = 0; x < width; ++x) {
+          img[(y * img.stride()) + x] = pattern(x + (2 * frame_no), y + frame_no);
+        }
+      }
+      std::ostringstream file_name;
+      file_name << prefix << "_" << std::setfill('0') << std::setw(4) << frame_no << ".pgm";
+      img.save(file_name.str());
+    }
+  } catch (std::exception& e) {
+    std::cerr << "EXCEPTION: " << e.what() << std::endl;
+    return 1;
+  }
+
+  return 0;
+}
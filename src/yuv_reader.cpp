@@ -0,0 +1,103 @@
+#include "yuv_reader.hpp"
+
+#include <sstream>
+#include <stdexcept>
+
+namespace lomc {
+yuv_reader::yuv_reader(const std::string& file_name)
+    : file_(file_name.c_str(), std::ios::in | std::ios::binary),
+      width_(0),
+      height_(0),
+      format_(PIXEL_FORMAT_YUV420),
+      is_y4m_(true) {
+  if (!file_) {
+    throw std::runtime_error("Failed to open " + file_name);
+  }
+  read_header();
+}
+
+yuv_reader::yuv_reader(const std::string& file_name, const int32_t width, const int32_t height)
+    : file_(file_name.c_str(), std::ios::in | std::ios::binary),
+      width_(width),
+      height_(height),
+      format_(PIXEL_FORMAT_YUV420),
+      is_y4m_(false) {
+  if (!file_) {
+    throw std::runtime_error("Failed to open " + file_name);
+  }
+  if (width_ < 1 || height_ < 1) {
+    throw std::runtime_error("Invalid raw video dimensions");
+  }
+}
+
+void yuv_reader::read_header() {
+  // The stream header is a single line of space separated parameters, e.g.
+  // "YUV4MPEG2 W640 H480 F30:1 Ip A1:1 C420jpeg".
+  std::string line;
+  if (!std::getline(file_, line)) {
+    throw std::runtime_error("Not a Y4M file");
+  }
+  std::istringstream params(line);
+  std::string param;
+  params >> param;
+  if (param != "YUV4MPEG2") {
+    throw std::runtime_error("Not a Y4M file");
+  }
+  while (params >> param) {
+    const std::string value = param.substr(1);
+    switch (param[0]) {
+      case 'W':
+        width_ = std::stoi(value);
+        break;
+      case 'H':
+        height_ = std::stoi(value);
+        break;
+      case 'C':
+        // The 8-bit 4:2:0 variants only differ in chroma siting, which does not matter here.
+        // High bit depth color spaces (e.g. 420p10) are not supported.
+        if (value == "mono") {
+          format_ = PIXEL_FORMAT_GRAY;
+        } else if (value != "420" && value != "420jpeg" && value != "420paldv" &&
+                   value != "420mpeg2") {
+          throw std::runtime_error("Unsupported Y4M color space: " + value);
+        }
+        break;
+      default:
+        break;
+    }
+  }
+  if (width_ < 1 || height_ < 1) {
+    throw std::runtime_error("Invalid Y4M header");
+  }
+}
+
+bool yuv_reader::read_frame(image* const* planes) {
+  // Each Y4M frame starts with a "FRAME" line (possibly with parameters).
+  if (is_y4m_) {
+    std::string line;
+    if (!std::getline(file_, line)) {
+      return false;
+    }
+    if (line.compare(0, 5, "FRAME") != 0) {
+      throw std::runtime_error("Invalid Y4M frame header");
+    }
+  } else if (file_.peek() == std::ifstream::traits_type::eof()) {
+    return false;
+  }
+
+  for (int32_t plane = 0; plane < num_planes(format_); ++plane) {
+    image& img = *planes[plane];
+    if (img.width() != plane_size(width_, format_, plane) ||
+        img.height() != plane_size(height_, format_, plane)) {
+      throw std::runtime_error("Incompatible plane dimensions");
+    }
+    for (int32_t y = 0; y < img.height(); ++y) {
+      file_.read(reinterpret_cast<char*>(&img[y * img.stride()]), img.width());
+    }
+  }
+  if (!file_) {
+    throw std::runtime_error("Truncated video frame");
+  }
+  return true;
+}
+}  // namespace lomc
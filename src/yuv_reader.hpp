@@ -0,0 +1,49 @@
+#ifndef YUV_READER_HPP_
+#define YUV_READER_HPP_
+
+#include "format.hpp"
+#include "image.hpp"
+
+#include <cstdint>
+#include <fstream>
+#include <string>
+
+namespace lomc {
+// Reader for planar video files: Y4M (4:2:0 or mono) or raw I420 (the Y, U and V planes of each
+// frame stored back to back, without any headers).
+class yuv_reader {
+public:
+  // Open a Y4M file.
+  explicit yuv_reader(const std::string& file_name);
+
+  // Open a raw I420 file with the given dimensions.
+  yuv_reader(const std::string& file_name, const int32_t width, const int32_t height);
+
+  // Read the next frame into the given planes (one image per plane, with the plane dimensions).
+  // Returns false at the end of the file.
+  bool read_frame(image* const* planes);
+
+  int32_t width() const {
+    return width_;
+  }
+
+  int32_t height() const {
+    return height_;
+  }
+
+  pixel_format format() const {
+    return format_;
+  }
+
+private:
+  void read_header();
+
+  std::ifstream file_;
+  int32_t width_;
+  int32_t height_;
+  pixel_format format_;
+  bool is_y4m_;
+};
+}  // namespace lomc
+
+#endif  // YUV_READER_HPP_